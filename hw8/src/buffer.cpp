@@ -0,0 +1,99 @@
+#include "buffer.h"
+#include <iostream>
+#include <vector>
+#include <cstdint>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+struct Mapping {
+    void *address;
+    size_t size;
+
+    Mapping(void *address, size_t size): address(address), size(size) {}
+    Mapping(const Mapping &) = delete;
+    Mapping &operator=(const Mapping &) = delete;
+
+    ~Mapping() {
+        if (address != nullptr) {
+            munmap(address, size);
+        }
+    }
+};
+
+// The whole file, or nullptr if it cannot be opened or mapped
+std::shared_ptr<const Mapping> mapFile(const std::string &path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return nullptr;
+    }
+    std::shared_ptr<const Mapping> result;
+    struct stat st;
+    if (fstat(fd, &st) == 0) {
+        size_t size = st.st_size;
+        void *address = size == 0 ? nullptr : mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (address != MAP_FAILED) {
+            result = std::make_shared<const Mapping>(address, size);
+        }
+    }
+    close(fd);
+    return result;
+}
+
+}
+
+Buffer::Buffer(const std::string &path, size_t size): size_(size) {
+    auto mapping = mapFile(path);
+    if (mapping && mapping->size >= size) {
+        data_ = static_cast<const char*>(mapping->address);
+        owner = mapping;
+        mapped = true;
+        return;
+    }
+    std::cerr << "Cannot map buffer " << path << " (" << size << " bytes)" << std::endl;
+    *this = zeros(size);
+}
+
+std::optional<Buffer> Buffer::map(const std::string &path) {
+    auto mapping = mapFile(path);
+    if (!mapping) {
+        return {};
+    }
+    Buffer result;
+    result.data_ = static_cast<const char*>(mapping->address);
+    result.size_ = mapping->size;
+    result.owner = mapping;
+    result.mapped = true;
+    return result;
+}
+
+Buffer Buffer::zeros(size_t size) {
+    auto zeros = std::make_shared<const std::vector<char>>(size, 0);
+    Buffer result;
+    result.data_ = zeros->data();
+    result.size_ = size;
+    result.owner = zeros;
+    return result;
+}
+
+Buffer Buffer::slice(size_t offset, size_t size) const {
+    Buffer result = *this;
+    result.data_ += offset;
+    result.size_ = size;
+    return result;
+}
+
+void Buffer::dropPages() const {
+    if (!mapped) {
+        return;
+    }
+    uintptr_t page = sysconf(_SC_PAGESIZE);
+    uintptr_t begin = (reinterpret_cast<uintptr_t>(data_) + page - 1) & ~(page - 1);
+    uintptr_t end = (reinterpret_cast<uintptr_t>(data_) + size_) & ~(page - 1);
+    if (begin < end) {
+        madvise(reinterpret_cast<void*>(begin), end - begin, MADV_DONTNEED);
+    }
+}
@@ -8,6 +8,10 @@ std::array<uint8_t, 3> toExternColorFormat(const Color &color) {
     return {ans0, ans1, ans2};
 }
 
+float luminance(const Color &color) {
+    return 0.2126f * color.x + 0.7152f * color.y + 0.0722f * color.z;
+}
+
 Color gamma_corrected(const Color &x) {
     float gamma = 1. / 2.2;
     return Color(pow(x.x, gamma), pow(x.y, gamma), pow(x.z, gamma));
@@ -0,0 +1,156 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include "primitives.h"
+#include "gltf_structs.h"
+
+/**
+ * Typed view of a glTF accessor inside its buffer. Elements are decoded on access, honouring the
+ * buffer view's byte stride, so geometry is read straight from the mapped buffer without copies.
+ * For uint32_t the element is an index of any glTF unsigned component type; vector elements may
+ * also be quantized (KHR_mesh_quantization) to 8 or 16-bit integers, normalized or not.
+ * Elements past the accessor's count read as zeros, so a bad index never leaves the view.
+ */
+template <typename T>
+class AccessorView {
+private:
+    const char *data = nullptr;
+    size_t count = 0;
+    size_t stride = 0;
+    size_t componentType = 0;
+    bool normalized = false;
+
+    template <typename U>
+    static U read(const char *p) {
+        U result;
+        std::memcpy(&result, p, sizeof(result));
+        return result;
+    }
+
+    static size_t componentSize(size_t componentType) {
+        return componentType == 5120 || componentType == 5121 ? 1 : (componentType == 5122 || componentType == 5123 ? 2 : 4);
+    }
+
+    // Component k of the vector element at p
+    float component(const char *p, int k) const {
+        switch (componentType) {
+            case 5120: {
+                float c = read<int8_t>(p + k);
+                return normalized ? std::max(c / 127.f, -1.f) : c;
+            }
+            case 5121: {
+                float c = read<uint8_t>(p + k);
+                return normalized ? c / 255.f : c;
+            }
+            case 5122: {
+                float c = read<int16_t>(p + 2 * k);
+                return normalized ? std::max(c / 32767.f, -1.f) : c;
+            }
+            case 5123: {
+                float c = read<uint16_t>(p + 2 * k);
+                return normalized ? c / 65535.f : c;
+            }
+            default:
+                return read<float>(p + 4 * k);
+        }
+    }
+
+public:
+    AccessorView() {}
+    AccessorView(const char *data, size_t count, size_t stride, size_t componentType, bool normalized)
+        : data(data), count(count), stride(stride), componentType(componentType), normalized(normalized) {}
+
+    static bool supports(size_t componentType);
+
+    // Size of a tightly packed element, the stride when the buffer view does not set one
+    static size_t elementSize(size_t componentType);
+
+    size_t size() const {
+        return count;
+    }
+
+    T operator[](size_t i) const;
+};
+
+template <typename T>
+inline bool AccessorView<T>::supports(size_t componentType) {
+    return componentType == 5126 || (componentType >= 5120 && componentType <= 5123);
+}
+
+template <>
+inline bool AccessorView<uint32_t>::supports(size_t componentType) {
+    return componentType == 5121 || componentType == 5123 || componentType == 5125;
+}
+
+// Vertex attribute elements start at multiples of 4 bytes
+template <>
+inline size_t AccessorView<Vec2>::elementSize(size_t componentType) {
+    return (2 * componentSize(componentType) + 3) & ~size_t(3);
+}
+
+template <>
+inline size_t AccessorView<Vec3>::elementSize(size_t componentType) {
+    return (3 * componentSize(componentType) + 3) & ~size_t(3);
+}
+
+template <>
+inline size_t AccessorView<Vec4>::elementSize(size_t componentType) {
+    return 4 * componentSize(componentType);
+}
+
+template <>
+inline size_t AccessorView<uint32_t>::elementSize(size_t componentType) {
+    return componentSize(componentType);
+}
+
+template <>
+inline Vec2 AccessorView<Vec2>::operator[](size_t i) const {
+    if (i >= count) {
+        return Vec2(0, 0);
+    }
+    const char *p = data + i * stride;
+    if (componentType == 5126) {
+        return Vec2(read<float>(p), read<float>(p + 4));
+    }
+    return Vec2(component(p, 0), component(p, 1));
+}
+
+template <>
+inline Vec3 AccessorView<Vec3>::operator[](size_t i) const {
+    if (i >= count) {
+        return Vec3(0, 0, 0);
+    }
+    const char *p = data + i * stride;
+    if (componentType == 5126) {
+        return Vec3(read<float>(p), read<float>(p + 4), read<float>(p + 8));
+    }
+    return Vec3(component(p, 0), component(p, 1), component(p, 2));
+}
+
+template <>
+inline Vec4 AccessorView<Vec4>::operator[](size_t i) const {
+    if (i >= count) {
+        return Vec4(0, 0, 0, 0);
+    }
+    const char *p = data + i * stride;
+    if (componentType == 5126) {
+        return Vec4(read<float>(p), read<float>(p + 4), read<float>(p + 8), read<float>(p + 12));
+    }
+    return Vec4(component(p, 0), component(p, 1), component(p, 2), component(p, 3));
+}
+
+template <>
+inline uint32_t AccessorView<uint32_t>::operator[](size_t i) const {
+    if (i >= count) {
+        return 0;
+    }
+    const char *p = data + i * stride;
+    if (componentType == 5121) {
+        return static_cast<uint8_t>(*p);
+    }
+    if (componentType == 5123) {
+        return read<uint16_t>(p);
+    }
+    return read<uint32_t>(p);
+}
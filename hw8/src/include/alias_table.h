@@ -0,0 +1,73 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+#include <algorithm>
+
+/**
+ * Walker/Vose alias table: O(1) sampling of an index proportionally to its weight.
+ */
+class AliasTable {
+private:
+    std::vector<float> threshold;
+    std::vector<uint32_t> alias;
+    std::vector<float> probs;
+
+public:
+    AliasTable() {}
+
+    AliasTable(const std::vector<float> &weights): threshold(weights.size(), 1), alias(weights.size()), probs(weights.size(), 0) {
+        double total = 0;
+        for (float w : weights) {
+            total += w;
+        }
+        size_t n = weights.size();
+        if (n == 0 || total <= 0) {
+            threshold.clear();
+            alias.clear();
+            probs.clear();
+            return;
+        }
+
+        std::vector<double> scaled(n);
+        std::vector<uint32_t> small, large;
+        for (size_t i = 0; i < n; i++) {
+            probs[i] = weights[i] / total;
+            scaled[i] = weights[i] / total * n;
+            alias[i] = i;
+            (scaled[i] < 1 ? small : large).push_back(i);
+        }
+        while (!small.empty() && !large.empty()) {
+            uint32_t s = small.back(), l = large.back();
+            small.pop_back();
+            threshold[s] = scaled[s];
+            alias[s] = l;
+            scaled[l] -= 1 - scaled[s];
+            if (scaled[l] < 1) {
+                large.pop_back();
+                small.push_back(l);
+            }
+        }
+        // Leftovers are 1 up to rounding errors
+        for (uint32_t i : small) {
+            threshold[i] = 1;
+        }
+        for (uint32_t i : large) {
+            threshold[i] = 1;
+        }
+    }
+
+    // Uses the integer part of u * size for the slot and the fractional part for the coin flip
+    uint32_t sample(float u) const {
+        float scaled = u * threshold.size();
+        uint32_t i = std::min<uint32_t>(scaled, threshold.size() - 1);
+        return scaled - i < threshold[i] ? i : alias[i];
+    }
+
+    float pdf(uint32_t i) const {
+        return probs[i];
+    }
+
+    size_t size() const {
+        return probs.size();
+    }
+};
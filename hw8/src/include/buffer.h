@@ -0,0 +1,41 @@
+#pragma once
+#include <cstddef>
+#include <memory>
+#include <optional>
+#include <string>
+
+/**
+ * Read-only bytes of a glTF buffer. Files are memory-mapped, so pages are read on first access
+ * and belong to the page cache rather than to the process heap. Copies and slices share the
+ * mapping, which stays alive while any of them does.
+ */
+class Buffer {
+private:
+    std::shared_ptr<const void> owner;
+    const char *data_ = nullptr;
+    size_t size_ = 0;
+    bool mapped = false;
+
+public:
+    Buffer() {}
+
+    // The first size bytes of a file; a file that cannot be mapped or is shorter reads as zeros
+    Buffer(const std::string &path, size_t size);
+
+    // The whole file, or nothing if it cannot be mapped
+    static std::optional<Buffer> map(const std::string &path);
+    static Buffer zeros(size_t size);
+
+    Buffer slice(size_t offset, size_t size) const;
+
+    // Lets the kernel drop the whole pages of a mapped file within these bytes; they are read again if touched
+    void dropPages() const;
+
+    const char *data() const {
+        return data_;
+    }
+
+    size_t size() const {
+        return size_;
+    }
+};
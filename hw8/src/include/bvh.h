@@ -3,6 +3,8 @@
 #include "vec3.h"
 #include "primitives.h"
 #include "quaternion.h"
+#include "storage.h"
+#include <algorithm>
 #include <cassert>
 #include <iostream>
 
@@ -17,32 +19,55 @@ public:
 
 class BVH {
 public:
-    std::vector<BvhNode> nodes;
+    Storage<BvhNode> nodes;
     uint32_t root; 
     mutable int counter = 0;
 
     BVH() {}
-    BVH(std::vector<Figure> &figures, uint32_t n) {
-        root = buildNode(figures, 0, n);
+
+    /**
+     * Builds over figures without moving them: order receives the figure indices in leaf order,
+     * and the figures must be permuted by it before the tree is used for intersection.
+     */
+    BVH(const Storage<Figure> &figures, std::vector<uint32_t> &order) {
+        order.resize(figures.size());
+        for (uint32_t i = 0; i < order.size(); i++) {
+            order[i] = i;
+        }
+        // A binary tree over n leaves of at least one figure has at most 2n - 1 nodes; reserving them
+        // avoids holding the old and new arrays at once on growth, and untouched capacity is never resident
+        nodes.reserve(std::max<size_t>(1, 2 * figures.size()));
+        root = buildNode(figures, order, 0, order.size());
     }
 
-    std::optional<std::pair<Intersection, int>> intersect(const std::vector<Figure> &figures, const Ray &ray, std::optional<float> curBest) const {
-        return intersect_(figures, root, ray, curBest);
+    std::optional<std::pair<Intersection, int>> intersect(const Storage<Figure> &figures, const Ray &ray, std::optional<float> curBest) const {
+        auto best = intersect_(figures, root, PreparedRay(ray), curBest);
+        if (!best.has_value()) {
+            return {};
+        }
+        auto [hit, figure] = best.value();
+        return {{figures[figure].interpolate(hit), figure}};
+    }
+
+    template <typename Archive>
+    void serialize(Archive &archive) {
+        archive.array(nodes);
+        archive.value(root);
     }
 
 private:
-    std::pair<float, uint32_t> bestSplit(std::vector<Figure> &figures, uint32_t first, uint32_t last) const {
+    std::pair<float, uint32_t> bestSplit(const Storage<Figure> &figures, const std::vector<uint32_t> &order, uint32_t first, uint32_t last) const {
         std::vector<float> scores(last - first, 0);
-        AABB prefixAABB(figures[first]);
+        AABB prefixAABB(figures[order[first]]);
         for (size_t i = 1; i < last - first; i++) {
             scores[i] = prefixAABB.getS() * i;
-            prefixAABB.extend(figures[first + i]);
+            prefixAABB.extend(figures[order[first + i]]);
         }
 
-        AABB suffixAABB(figures[last - 1]);
+        AABB suffixAABB(figures[order[last - 1]]);
         for (size_t i = last - first - 1; i >= 1; i--) {
             scores[i] += suffixAABB.getS() * ((last - first) - i);
-            suffixAABB.extend(figures[first + i - 1]);
+            suffixAABB.extend(figures[order[first + i - 1]]);
         }
         std::pair<float, uint32_t> ans = {scores[1], first + 1};
         for (size_t i = 2; i < last - first; i++) {
@@ -57,21 +82,22 @@ private:
         X, Y, Z
     };
 
-    void halfSplit(std::vector<Figure> &figures, uint32_t first, uint32_t last, Axis axis) const {
-        auto cmp = axis == Axis::X ? [](const Figure &lhs, const Figure &rhs) { return lhs.data3.coords.x < rhs.data3.coords.x; } : 
-                  (axis == Axis::Y ? [](const Figure &lhs, const Figure &rhs) { return lhs.data3.coords.y < rhs.data3.coords.y; } : 
-                                     [](const Figure &lhs, const Figure &rhs) { return lhs.data3.coords.z < rhs.data3.coords.z; });
-        std::sort(figures.begin() + first, figures.begin() + last, cmp);
+    void halfSplit(const Storage<Figure> &figures, std::vector<uint32_t> &order, uint32_t first, uint32_t last, Axis axis) const {
+        auto key = [&figures, axis](uint32_t figure) {
+            const Vec3 &c = figures[figure].data3.coords;
+            return axis == Axis::X ? c.x : (axis == Axis::Y ? c.y : c.z);
+        };
+        std::sort(order.begin() + first, order.begin() + last, [&key](uint32_t lhs, uint32_t rhs) { return key(lhs) < key(rhs); });
     }
 
-    uint32_t buildNode(std::vector<Figure> &figures, uint32_t first, uint32_t last) {
+    uint32_t buildNode(const Storage<Figure> &figures, std::vector<uint32_t> &order, uint32_t first, uint32_t last) {
         BvhNode cur = BvhNode(first, last);
         AABB aabb;
         if (first < last) {
-            aabb = AABB(figures[first]);
+            aabb = AABB(figures[order[first]]);
         }
         for (uint32_t i = first + 1; i < last; i++) {
-            aabb.extend(figures[i]);
+            aabb.extend(figures[order[i]]);
         }
         cur.aabb = aabb;
         uint32_t thisPos = nodes.size();
@@ -80,12 +106,12 @@ private:
             return thisPos;
         }
 
-        halfSplit(figures, first, last, Axis::X);
-        auto splitX = bestSplit(figures, first, last);
-        halfSplit(figures, first, last, Axis::Y);
-        auto splitY = bestSplit(figures, first, last);
-        halfSplit(figures, first, last, Axis::Z);
-        auto splitZ = bestSplit(figures, first, last);
+        halfSplit(figures, order, first, last, Axis::X);
+        auto splitX = bestSplit(figures, order, first, last);
+        halfSplit(figures, order, first, last, Axis::Y);
+        auto splitY = bestSplit(figures, order, first, last);
+        halfSplit(figures, order, first, last, Axis::Z);
+        auto splitZ = bestSplit(figures, order, first, last);
 
         float bestResult = std::min(splitX.first, std::min(splitY.first, splitZ.first));
         if (bestResult >= aabb.getS() * (last - first)) {
@@ -95,34 +121,36 @@ private:
         uint32_t mid;
         if (bestResult == splitX.first) {
             mid = splitX.second;
-            halfSplit(figures, first, last, Axis::X);
+            halfSplit(figures, order, first, last, Axis::X);
         } else if (bestResult == splitY.first) {
             mid = splitY.second;
-            halfSplit(figures, first, last, Axis::Y);
+            halfSplit(figures, order, first, last, Axis::Y);
         } else {
             mid = splitZ.second;
-            halfSplit(figures, first, last, Axis::Z);
+            halfSplit(figures, order, first, last, Axis::Z);
         }
-        nodes[thisPos].left = buildNode(figures, first, mid);
-        nodes[thisPos].right = buildNode(figures, mid, last);
+        uint32_t left = buildNode(figures, order, first, mid);
+        uint32_t right = buildNode(figures, order, mid, last);
+        nodes.mutableData()[thisPos].left = left;
+        nodes.mutableData()[thisPos].right = right;
         return thisPos;
     }
 
-    std::optional<std::pair<Intersection, int>> intersect_(const std::vector<Figure> &figures, uint32_t pos, const Ray &ray, std::optional<float> curBest) const {
+    std::optional<std::pair<TriangleHit, int>> intersect_(const Storage<Figure> &figures, uint32_t pos, const PreparedRay &ray, std::optional<float> curBest) const {
         const BvhNode &cur = nodes[pos];
         auto intersection = cur.aabb.intersect(ray);
         if (!intersection.has_value()) {
             return {};
         }
-        auto [t, _, _2, _3, _4, isInside] = intersection.value();
+        auto [t, isInside] = intersection.value();
         if (curBest.has_value() && curBest.value() < t && !isInside) {
             return {};
         }
 
-        std::optional<std::pair<Intersection, int>> bestIntersection = {};
+        std::optional<std::pair<TriangleHit, int>> bestIntersection = {};
         if (cur.left == 0) {
             for (uint32_t i = cur.first; i < cur.last; i++) {
-                auto curIntersection = figures[i].intersect(ray);
+                auto curIntersection = figures[i].hit(ray);
                 if (curIntersection.has_value() && (!bestIntersection.has_value() || curIntersection.value().t < bestIntersection.value().first.t)) {
                     bestIntersection = {curIntersection.value(), i};
                 }
@@ -140,4 +168,4 @@ private:
         }
         return bestIntersection;
     }
-};
\ No newline at end of file
+};
@@ -1,11 +1,14 @@
 #pragma once
 #include <inttypes.h>
 #include <algorithm>
+#include <array>
 #include "vec3.h"
 
 using Color = Vec3;
 
 std::array<uint8_t, 3> toExternColorFormat(const Color &color);
 
+float luminance(const Color &color);
+
 Color gamma_corrected(const Color &x);
 Color aces_tonemap(const Color &x);
\ No newline at end of file
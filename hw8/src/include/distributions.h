@@ -1,280 +1,478 @@
 #pragma once
-#include <random>
+#include <algorithm>
 #include <cmath>
 #include <memory>
+#include <tuple>
+#include <type_traits>
 #include <variant>
 #include "vec3.h"
 #include "primitives.h"
 #include "bvh.h"
+#include "sampler.h"
+#include "light_tree.h"
+#include "alias_table.h"
+#include "environment_map.h"
+#include "shading.h"
+
+// Target of a light sample that has to escape the scene
+static constexpr int ENVIRONMENT_TARGET = -1;
+
+struct DirectionSample {
+    Vec3 d;
+    // Figure aimed at by light sampling (or ENVIRONMENT_TARGET): the sample only counts if the ray reaches it first
+    std::optional<int> target;
+};
 
-typedef std::minstd_rand rng_type;
-
-class Uniform {
-public:
-    Uniform() {}
-
-    Vec3 sample(std::normal_distribution<float> &n01, rng_type &rng, Vec3 x, Vec3 n) {
-        (void) x;
-        Vec3 d = Vec3 {n01(rng), n01(rng), n01(rng)}.normalize();
-        if (d.dot(n) < 0) {
-            d = -1. * d;
-        }
-        return d;
+inline bool reachesTarget(const std::optional<int> &target, const std::optional<std::pair<Intersection, int>> &hit) {
+    if (!target.has_value()) {
+        return true;
     }
-
-    float pdf(Vec3 x, Vec3 n, Vec3 d) const {
-        (void) x;
-        if (d.dot(n) < 0) {
-            return 0;
-        }
-        return 1. / (2. * M_PI);
+    if (target.value() == ENVIRONMENT_TARGET) {
+        return !hit.has_value();
     }
-};
-
+    return hit.has_value() && hit.value().second == target.value();
+}
 
 class Cosine {
-private:
-    static constexpr float eps = 1e-9;
-
 public:
+    static constexpr bool IS_LIGHT = false;
+
     Cosine() {}
 
-    Vec3 sample(std::normal_distribution<float> &n01, rng_type &rng, Vec3 x, Vec3 n) {
-        (void) x;
-        Vec3 d = Vec3 {n01(rng), n01(rng), n01(rng)}.normalize();
-        d = d + n;
-        float len = d.len();
-        if (len <= eps || d.dot(n) <= eps || std::isnan(len)) {
-            // Can happen due to precision errors
-            return n;
+    // Share of the BRDF samples at the point, see Mix
+    float weight(const ShadingPoint &point) const {
+        return 1 - point.specularShare;
+    }
+
+    Vec3 sample(Sampler &sampler, const ShadingPoint &point) const {
+        // Malley's method: concentric disk sample lifted onto the hemisphere
+        float u = 2.f * sampler.get1D() - 1.f;
+        float v = 2.f * sampler.get1D() - 1.f;
+        float r, phi;
+        if (u == 0 && v == 0) {
+            return point.n;
+        }
+        if (std::fabs(u) > std::fabs(v)) {
+            r = u;
+            phi = (float) M_PI_4 * (v / u);
+        } else {
+            r = v;
+            phi = (float) M_PI_2 - (float) M_PI_4 * (u / v);
         }
-        return 1. / len * d;
+        float z = std::sqrt(std::max(0.f, 1.f - r * r));
+        return point.toWorld(Vec3(r * std::cos(phi), r * std::sin(phi), z));
     }
 
-    float pdf(Vec3 x, Vec3 n, Vec3 d) const {
-        (void) x;
-        return std::max(0.f, d.dot(n) / (float) M_PI);
+    float pdf(const ShadingPoint &point, Vec3 d) const {
+        return std::max(0.f, d.dot(point.n) / (float) M_PI);
     }
 };
 
-class TriangleLight {
+/**
+ * The emissive triangles of a scene as a table of columns, one row per light. Sampling reads
+ * the positions (a corner and two edges), the density reads the unit normal and reciprocal area,
+ * and figure refers each row back to the scene figure it was made from.
+ */
+class EmissiveTriangles {
 private:
-    float pointProb;
+    std::vector<Vec3> corners, edges1, edges2;
+    std::vector<Vec3> normals;
+    std::vector<float> reciprocalAreas;
+    std::vector<int32_t> figures;
 
 public:
-    const Figure figure;
-    
-public:
-    float pdfOne(Vec3 x, Vec3 d, Vec3 y, Vec3 yn) const {
-        return pointProb * (x - y).len2() / fabs(d.dot(yn));
+    size_t size() const {
+        return figures.size();
     }
 
-public:
-    TriangleLight(const Figure &ellipsoid): figure(ellipsoid) {
+    void push(const Figure &figure, int32_t index) {
         const Vec3 &a = figure.data3.coords;
-        const Vec3 &b = figure.data.coords - a;
-        const Vec3 &c = figure.data2.coords - a;
+        Vec3 b = figure.data.coords - a, c = figure.data2.coords - a;
         Vec3 n = b.cross(c);
-        pointProb = 1.0 / (0.5 * n.len());
+        corners.push_back(a);
+        edges1.push_back(b);
+        edges2.push_back(c);
+        normals.push_back(n.normalize());
+        reciprocalAreas.push_back(1.f / (0.5f * n.len()));
+        figures.push_back(index);
     }
 
-    Vec3 sample(std::uniform_real_distribution<float> &u01, rng_type &rng, Vec3 x, Vec3 n) {
-        (void) n;
-        const Vec3 &a = figure.data3.coords;
-        const Vec3 &b = figure.data.coords - a;
-        const Vec3 &c = figure.data2.coords - a;
-        float u = u01(rng);
-        float v = u01(rng);
-        if (u + v > 1.) {
+    float area(size_t light) const {
+        return 1.f / reciprocalAreas[light];
+    }
+
+    const Vec3 &normal(size_t light) const {
+        return normals[light];
+    }
+
+    int32_t figure(size_t light) const {
+        return figures[light];
+    }
+
+    void setFigure(size_t light, int32_t index) {
+        figures[light] = index;
+    }
+
+    // Uniform point of the triangle for a uniform (u, v) in [0, 1)^2
+    Vec3 point(size_t light, float u, float v) const {
+        if (u + v > 1.f) {
             u = 1 - u;
             v = 1 - v;
         }
-        Vec3 point = a + u * b + v * c;
-        return (point - x).normalize();
+        return corners[light] + u * edges1[light] + v * edges2[light];
+    }
+
+    // Solid angle density at x of the direction d to the point y on the light
+    float pdf(size_t light, Vec3 x, Vec3 d, Vec3 y) const {
+        return reciprocalAreas[light] * (x - y).len2() / std::fabs(d.dot(normals[light]));
+    }
+
+    template <typename Archive>
+    void serialize(Archive &archive) {
+        archive.array(corners);
+        archive.array(edges1);
+        archive.array(edges2);
+        archive.array(normals);
+        archive.array(reciprocalAreas);
+        archive.array(figures);
     }
 };
 
 class FiguresMix {
 private:
-    std::vector<TriangleLight> figures_;
-    BVH bvh;
+    EmissiveTriangles lights;
+    std::vector<int32_t> lightByFigure;
+    LightTree selection;
 
 public:
-    FiguresMix(std::vector<Figure> figures) {
-        size_t n = std::partition(figures.begin(), figures.end(), [](const auto &fig) {
+    static constexpr bool IS_LIGHT = true;
+
+    FiguresMix() {}
+
+    // materialPower holds the emitted luminance per material, a triangle's power is its area times that
+    FiguresMix(const Storage<Figure> &figures, const std::vector<float> &materialPower): lightByFigure(figures.size(), -1) {
+        std::vector<LightBounds> lightBounds;
+        for (size_t i = 0; i < figures.size(); i++) {
+            const auto &fig = figures[i];
             if (fig.material.emission.x == 0 && fig.material.emission.y == 0 && fig.material.emission.z == 0) {
-                return false;
+                continue;
             }
-            return true;
-        }) - figures.begin();
-
-        bvh = BVH(figures, n);
-        for (size_t i = 0; i < n; i++) {
-            figures_.push_back(TriangleLight(figures[i]));
+            size_t light = lights.size();
+            lightByFigure[i] = light;
+            lights.push(fig, i);
+            float power = lights.area(light) * materialPower[fig.materialIndex];
+            lightBounds.push_back(LightBounds(AABB(fig), lights.normal(light), 1, power));
         }
+        selection = LightTree(lightBounds);
+    }
+
+    float weight(const ShadingPoint &point) const {
+        (void) point;
+        return 1;
     }
 
-    Vec3 sample(std::uniform_real_distribution<float> &u01, rng_type &rng, Vec3 x, Vec3 n) {
-        int distNum = u01(rng) * figures_.size();
-        return figures_[distNum].sample(u01, rng, x, n);
+    DirectionSample sample(Sampler &sampler, const ShadingPoint &point) const {
+        uint32_t light = selection.sample(sampler.get1D(), point.x, point.n);
+        float u = sampler.get1D();
+        float v = sampler.get1D();
+        return {(lights.point(light, u, v) - point.x).normalize(), lights.figure(light)};
     }
 
-    float pdf(Vec3 x, Vec3 n, Vec3 d) const {
-        return getTotalPdf(0, x, n, d) / figures_.size();
+    /**
+     * Density of sampling d, taken from the emitter that the ray (x, d) hits first.
+     * Samples aimed at an emitter hidden behind something else are discarded by the caller,
+     * so emitters further along the ray never produce d and do not add to its density.
+     */
+    float pdf(const ShadingPoint &point, Vec3 d, const std::optional<std::pair<Intersection, int>> &hit) const {
+        if (!hit.has_value()) {
+            return 0;
+        }
+        int32_t light = lightByFigure[hit.value().second];
+        if (light < 0) {
+            return 0;
+        }
+        Vec3 y = point.x + hit.value().first.t * d;
+        return selection.pdf(light, point.x, point.n) * lights.pdf(light, point.x, d, y);
     }
 
     bool isEmpty() const {
-        return figures_.empty();
+        return lights.size() == 0;
     }
 
+    // Follows the figures being permuted so that order[newIndex] == oldIndex
+    void reorderFigures(const std::vector<uint32_t> &order) {
+        std::vector<int32_t> reordered(order.size(), -1);
+        for (size_t i = 0; i < order.size(); i++) {
+            reordered[i] = lightByFigure[order[i]];
+            if (reordered[i] >= 0) {
+                lights.setFigure(reordered[i], i);
+            }
+        }
+        lightByFigure = std::move(reordered);
+    }
+
+    template <typename Archive>
+    void serialize(Archive &archive) {
+        lights.serialize(archive);
+        archive.array(lightByFigure);
+        selection.serialize(archive);
+    }
+};
+
+/**
+ * Environment map as a light: texels of its octahedral grid are picked proportionally to luminance
+ * times the solid angle they cover, then a point is taken uniformly inside the texel.
+ */
+class EnvironmentLight {
 private:
-    float pdfOneFigureLight(const TriangleLight &figureLight, Vec3 x, Vec3 n, Vec3 d) const {
-        (void) n;
+    int size = 0;
+    AliasTable texels;
 
-        const Figure &figure = figureLight.figure;
+public:
+    static constexpr bool IS_LIGHT = true;
 
-        auto firstIntersection = figure.intersect(Ray(x, d));
-        if (!firstIntersection.has_value()) {
-            return 0.;
-        }
-        auto [t, yn, _, shn, _3, _4] = firstIntersection.value(); // TODO: think between shading and geom here
-        if (std::isnan(t)) { // Shouldn't happen actually...
-            return INFINITY;
+    EnvironmentLight() {}
+
+    EnvironmentLight(const EnvironmentMap &map): size(map.size()) {
+        std::vector<float> weights(static_cast<size_t>(size) * size);
+        for (int iy = 0; iy < size; iy++) {
+            for (int ix = 0; ix < size; ix++) {
+                Vec3 d = octahedralDecode((ix + 0.5f) / size, (iy + 0.5f) / size);
+                weights[ix + static_cast<size_t>(size) * iy] = luminance(map.at(ix, iy)) * octahedralJacobian(d);
+            }
         }
-        Vec3 y = x + t * d;
-        return figureLight.pdfOne(x, d, y, shn.value());
+        texels = AliasTable(weights);
     }
 
-    float getTotalPdf(uint32_t pos, const Vec3 &x, const Vec3 &n, const Vec3 &d) const {
-        Ray ray(x, d);
-        const BvhNode &cur = bvh.nodes[pos];
-        auto intersection = cur.aabb.intersect(ray);
-        if (!intersection.has_value()) {
-            return 0;
-        }    
+    float weight(const ShadingPoint &point) const {
+        (void) point;
+        return 1;
+    }
 
-        if (cur.left == 0) {
-            float result = 0;
-            for (uint32_t i = cur.first; i < cur.last; i++) {
-                result += pdfOneFigureLight(figures_[i], x, n, d);
-            }
-            return result;
+    DirectionSample sample(Sampler &sampler, const ShadingPoint &point) const {
+        (void) point;
+        uint32_t texel = texels.sample(sampler.get1D());
+        float u = (texel % size + sampler.get1D()) / size;
+        float v = (texel / size + sampler.get1D()) / size;
+        return {octahedralDecode(u, v), ENVIRONMENT_TARGET};
+    }
+
+    float pdf(const ShadingPoint &point, Vec3 d, const std::optional<std::pair<Intersection, int>> &hit) const {
+        (void) point;
+        if (hit.has_value()) {
+            return 0;
         }
+        Vec2 uv = octahedralEncode(d);
+        int ix = std::clamp<int>(uv.x * size, 0, size - 1);
+        int iy = std::clamp<int>(uv.y * size, 0, size - 1);
+        return texels.pdf(ix + iy * size) * size * size / octahedralJacobian(d);
+    }
 
-        return getTotalPdf(cur.left, x, n, d) + getTotalPdf(cur.right, x, n, d);
-    }    
+    bool isEmpty() const {
+        return texels.size() == 0;
+    }
 };
 
 class Vndf {
 private:
-    Vec3 sample_(std::uniform_real_distribution<float> &u01, rng_type &rng, Vec3 v, float alpha_) const {
+    Vec3 sample_(Sampler &sampler, Vec3 v, float alpha_) const {
         // Section 3.2: transforming the view direction to the hemisphere configuration
         Vec3 vh = Vec3(alpha_ * v.x, alpha_ * v.y, v.z).normalize();
 
         // Section 4.1: orthonormal basis (with special case if cross product is zero)
         float lensq = vh.x * vh.x + vh.y * vh.y;
-        Vec3 T1 = lensq > 0 ? 1. / sqrt(lensq) * Vec3(-vh.y, vh.x, 0) : Vec3(1, 0, 0);
+        Vec3 T1 = lensq > 0 ? (1.f / std::sqrt(lensq)) * Vec3(-vh.y, vh.x, 0) : Vec3(1, 0, 0);
         Vec3 T2 = T1.cross(vh);
 
         // Section 4.2: parameterization of the projected area
-        float u1 = u01(rng), u2 = u01(rng);
-        float r = sqrt(u1);
-        float phi = 2.0 * M_PI * u2;
-        float t1 = r * cos(phi);
-        float t2 = r * sin(phi);
-        float s = 0.5 * (1.0 + vh.z);
-        t2 = (1.0 - s) * sqrt(1.f - t1 * t1) + s * t2;
+        float u1 = sampler.get1D(), u2 = sampler.get1D();
+        float r = std::sqrt(u1);
+        float phi = 2.f * (float) M_PI * u2;
+        float t1 = r * std::cos(phi);
+        float t2 = r * std::sin(phi);
+        float s = 0.5f * (1.f + vh.z);
+        t2 = (1.f - s) * std::sqrt(1.f - t1 * t1) + s * t2;
 
         // Section 4.3: reprojection onto hemisphere
-        Vec3 nh = t1 * T1 + t2 * T2 + sqrt(std::max<float>(0.f, 1.0 - t1 * t1 - t2 * t2)) * vh;
+        Vec3 nh = t1 * T1 + t2 * T2 + std::sqrt(std::max(0.f, 1.f - t1 * t1 - t2 * t2)) * vh;
 
         // Section 3.4: transforming the normal back to the ellipsoid configuration
-        Vec3 ne = Vec3(alpha_ * nh.x, alpha_ * nh.y, std::max<float>(0.0, nh.z)).normalize();
+        Vec3 ne = Vec3(alpha_ * nh.x, alpha_ * nh.y, std::max(0.f, nh.z)).normalize();
         return 2 * ne.dot(v) * ne - v;
     }
 
     float D(Vec3 n, float alpha_) const {
-        return 1. / (M_PI * alpha_ * alpha_ * pow(n.x * n.x / (alpha_ * alpha_) + n.y * n.y / (alpha_ * alpha_) + n.z * n.z, 2.0));
+        float alpha2 = alpha_ * alpha_;
+        float k = n.x * n.x / alpha2 + n.y * n.y / alpha2 + n.z * n.z;
+        return 1.f / ((float) M_PI * alpha2 * k * k);
     }
 
     float G1(Vec3 v, float alpha_) const {
-        float lambda = 0.5 * (-1 + sqrt(1 + (alpha_ * alpha_ * v.x * v.x + alpha_ * alpha_ * v.y * v.y) / (v.z * v.z)));
-        return 1. / (1 + lambda);
+        float lambda = 0.5f * (-1 + std::sqrt(1 + (alpha_ * alpha_ * v.x * v.x + alpha_ * alpha_ * v.y * v.y) / (v.z * v.z)));
+        return 1.f / (1 + lambda);
     }
 
     float pdf_(Vec3 d, Vec3 v, float alpha_) const {
         Vec3 ni = (v + d).normalize();
-        float dv = G1(v, alpha_) * std::max(0.f, v.dot(ni)) * D(ni, alpha_) / fabs(v.z);
+        float dv = G1(v, alpha_) * std::max(0.f, v.dot(ni)) * D(ni, alpha_) / std::fabs(v.z);
         float res = dv / (4 * v.dot(ni));
         return res;
     }
 
-    Quaternion getQ(Vec3 n) const {
-        Vec3 newN = {0, 0, 1};
-        if (n.dot(newN) > 0.9999) {
-            return {};
-        }
-        if (n.dot(newN) < -0.9999) {
-            return Quaternion{0, 0, 0, -1};
-        }
-        Vec3 a = n.cross(newN);
-        float w = sqrt(n.len2()) + n.dot(newN);
-        float len = sqrt(a.len2() + w * w);
-        return Quaternion{1. / len * a, w / len};
-    }
-
 public:
+    static constexpr bool IS_LIGHT = false;
+
     Vndf() {}
 
-    Vec3 sample(std::uniform_real_distribution<float> &u01, rng_type &rng, Vec3 x, Vec3 n, Vec3 v, float alpha_) const {
-        (void) x;
-        v = -1. * v;
-        auto q = getQ(n);
-        auto vTransformed = q.transform(v);
-        auto dTransformed = sample_(u01, rng, vTransformed, alpha_);
-        Vec3 res = q.conjugate().transform(dTransformed);
-        return res;
+    float weight(const ShadingPoint &point) const {
+        return point.specularShare;
     }
 
-    float pdf(Vec3 x, Vec3 n, Vec3 d, Vec3 v, float alpha_) const {
-        (void) x;
-        v = -1. * v;
-        auto q = getQ(n);
-        float res = pdf_(q.transform(d), q.transform(v), alpha_);
-        return res;
+    // sample_ and pdf_ work in the local frame of the point, where the normal is z
+    Vec3 sample(Sampler &sampler, const ShadingPoint &point) const {
+        return point.toWorld(sample_(sampler, point.localV, point.alpha));
+    }
+
+    float pdf(const ShadingPoint &point, Vec3 d) const {
+        return pdf_(point.toLocal(d), point.localV, point.alpha);
     }
 };
 
+/**
+ * One-sample mixture of direction strategies, composed at compile time so that every call
+ * inlines into a fixed sequence over the strategies with no dispatch per bounce.
+ * Strategies are split into BRDF-driven and light-driven ones (IS_LIGHT), so next-event estimation
+ * can sample and weight the two groups separately. Each group gets a share of the samples
+ * proportional to its size; within a group strategies split it by their weight at the point,
+ * so Cosine and Vndf follow the specular share of the material and lights split evenly.
+ */
+template <typename... Strategies>
 class Mix {
 private:
-    std::vector<std::variant<Cosine, Vndf, FiguresMix>> components;
+    std::tuple<Strategies...> strategies;
+
+    static constexpr size_t LIGHT_COUNT = (0 + ... + static_cast<size_t>(Strategies::IS_LIGHT));
+    static constexpr size_t BSDF_COUNT = sizeof...(Strategies) - LIGHT_COUNT;
+    static constexpr float BSDF_SHARE = static_cast<float>(BSDF_COUNT) / sizeof...(Strategies);
+
+    template <typename Strategy>
+    static DirectionSample sampleOne(const Strategy &strategy, Sampler &sampler, const ShadingPoint &point) {
+        if constexpr (Strategy::IS_LIGHT) {
+            return strategy.sample(sampler, point);
+        } else {
+            return {strategy.sample(sampler, point), {}};
+        }
+    }
+
+    template <typename Strategy>
+    static float pdfOne(const Strategy &strategy, const ShadingPoint &point, Vec3 d, const std::optional<std::pair<Intersection, int>> &hit) {
+        if constexpr (Strategy::IS_LIGHT) {
+            return strategy.pdf(point, d, hit);
+        } else {
+            return strategy.pdf(point, d);
+        }
+    }
+
+    // Calls f on each strategy of the group, in order
+    template <bool LIGHT, typename F>
+    void forEachIn(F &&f) const {
+        std::apply([&f](const auto &... strategy) {
+            ([&f](const auto &s) {
+                if constexpr (std::decay_t<decltype(s)>::IS_LIGHT == LIGHT) {
+                    f(s);
+                }
+            }(strategy), ...);
+        }, strategies);
+    }
+
+    // Picks a strategy of the group by weight with the single number u in [0, 1) and samples it
+    template <bool LIGHT>
+    DirectionSample sampleFrom(float u, Sampler &sampler, const ShadingPoint &point) const {
+        float total = 0;
+        forEachIn<LIGHT>([&](const auto &s) {
+            total += s.weight(point);
+        });
+        u *= total;
+        size_t left = LIGHT ? LIGHT_COUNT : BSDF_COUNT;
+        std::optional<DirectionSample> result;
+        forEachIn<LIGHT>([&](const auto &s) {
+            left--;
+            u -= s.weight(point);
+            if (!result.has_value() && (u < 0 || left == 0)) {
+                result = sampleOne(s, sampler, point);
+            }
+        });
+        return result.value_or(DirectionSample{point.n, {}});
+    }
+
+    template <bool LIGHT>
+    float pdfFrom(const ShadingPoint &point, Vec3 d, const std::optional<std::pair<Intersection, int>> &hit) const {
+        float ans = 0, total = 0;
+        forEachIn<LIGHT>([&](const auto &s) {
+            float w = s.weight(point);
+            ans += w * pdfOne(s, point, d, hit);
+            total += w;
+        });
+        return total > 0 ? ans / total : 0;
+    }
 
 public:
     Mix() {}
-    Mix(const std::vector<std::variant<Cosine, Vndf, FiguresMix>> &components): components(components) {}
-
-    Vec3 sample(std::uniform_real_distribution<float> &u01, std::normal_distribution<float> &n01, rng_type &rng, Vec3 x, Vec3 n, Vec3 v, float alpha) {
-        int distNum = u01(rng) * components.size();
-        if (std::holds_alternative<Cosine>(components[distNum])) {
-            return std::get<Cosine>(components[distNum]).sample(n01, rng, x, n);
-        } else if (std::holds_alternative<FiguresMix>(components[distNum])) {
-            return std::get<FiguresMix>(components[distNum]).sample(u01, rng, x, n);
+    Mix(Strategies... strategies): strategies(std::move(strategies)...) {}
+
+    DirectionSample sample(Sampler &sampler, const ShadingPoint &point) const {
+        // One number picks the group, then is rescaled to pick within it
+        float u = sampler.get1D();
+        if (u < BSDF_SHARE) {
+            return sampleFrom<false>(std::min(u / BSDF_SHARE, 1.f), sampler, point);
+        }
+        return sampleFrom<true>(std::min((u - BSDF_SHARE) / (1 - BSDF_SHARE), 1.f), sampler, point);
+    }
+
+    float pdf(const ShadingPoint &point, Vec3 d, const std::optional<std::pair<Intersection, int>> &hit) const {
+        return BSDF_SHARE * pdfFrom<false>(point, d, hit) + (1 - BSDF_SHARE) * pdfFrom<true>(point, d, hit);
+    }
+
+    bool hasLights() const {
+        return LIGHT_COUNT > 0;
+    }
+
+    // The emitter strategy, if the scene has emitters
+    FiguresMix *figuresMix() {
+        if constexpr ((std::is_same_v<Strategies, FiguresMix> || ...)) {
+            return &std::get<FiguresMix>(strategies);
         } else {
-            return std::get<Vndf>(components[distNum]).sample(u01, rng, x, n, v, alpha);   
+            return nullptr;
         }
     }
 
-    float pdf(Vec3 x, Vec3 n, Vec3 d, Vec3 v, float alpha) const {
-        float ans = 0;
-        for (const auto &component : components) {
-            if (std::holds_alternative<Cosine>(component)) {
-                ans += std::get<Cosine>(component).pdf(x, n, d);
-            } else if (std::holds_alternative<FiguresMix>(component)) {
-                ans += std::get<FiguresMix>(component).pdf(x, n, d);
-            } else {
-                ans += std::get<Vndf>(component).pdf(x, n, d, v, alpha);
-            }
+    void reorderFigures(const std::vector<uint32_t> &order) {
+        if (FiguresMix *lights = figuresMix()) {
+            lights->reorderFigures(order);
         }
-        return ans / components.size();
     }
-};
\ No newline at end of file
+
+    DirectionSample sampleBsdf(Sampler &sampler, const ShadingPoint &point) const {
+        return sampleFrom<false>(sampler.get1D(), sampler, point);
+    }
+
+    float pdfBsdf(const ShadingPoint &point, Vec3 d) const {
+        return pdfFrom<false>(point, d, {});
+    }
+
+    DirectionSample sampleLight(Sampler &sampler, const ShadingPoint &point) const {
+        return sampleFrom<true>(sampler.get1D(), sampler, point);
+    }
+
+    float pdfLight(const ShadingPoint &point, Vec3 d, const std::optional<std::pair<Intersection, int>> &hit) const {
+        return pdfFrom<true>(point, d, hit);
+    }
+};
+
+// The mixtures a scene can need: with or without emissive figures and an environment map
+using SceneDistribution = std::variant<
+    Mix<Cosine, Vndf>,
+    Mix<Cosine, Vndf, FiguresMix>,
+    Mix<Cosine, Vndf, EnvironmentLight>,
+    Mix<Cosine, Vndf, FiguresMix, EnvironmentLight>
+>;
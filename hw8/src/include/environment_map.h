@@ -0,0 +1,56 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <vector>
+#include "vec3.h"
+#include "color.h"
+#include "primitives.h"
+
+// Solid angle per unit of texcoord area at d: dw = 4 |d|_1^3 du dv
+inline float octahedralJacobian(const Vec3 &d) {
+    float l1 = std::fabs(d.x) + std::fabs(d.y) + std::fabs(d.z);
+    return 4 * l1 * l1 * l1;
+}
+
+/**
+ * Environment radiance resampled once into a square octahedral grid of linear colors,
+ * so a lookup is an encode and a bilinear fetch.
+ */
+class EnvironmentMap {
+private:
+    int size_ = 0;
+    std::vector<Color> texels;
+
+    // Texels outside the grid are mirrored across the edge midpoint, as the octahedron folds there
+    const Color &texel(int ix, int iy) const {
+        if (ix < 0 || ix >= size_) {
+            ix = std::clamp(ix, 0, size_ - 1);
+            iy = size_ - 1 - iy;
+        }
+        if (iy < 0 || iy >= size_) {
+            iy = std::clamp(iy, 0, size_ - 1);
+            ix = size_ - 1 - ix;
+        }
+        return texels[ix + iy * size_];
+    }
+
+public:
+    EnvironmentMap() {}
+    EnvironmentMap(int size, std::vector<Color> texels): size_(size), texels(std::move(texels)) {}
+
+    int size() const {
+        return size_;
+    }
+
+    const Color &at(int ix, int iy) const {
+        return texels[ix + iy * size_];
+    }
+
+    Color lookup(const Vec3 &d) const {
+        Vec2 uv = octahedralEncode(d);
+        float x = uv.x * size_ - 0.5f, y = uv.y * size_ - 0.5f;
+        int ix = std::floor(x), iy = std::floor(y);
+        float dx = x - ix, dy = y - iy;
+        return (1 - dx) * ((1 - dy) * texel(ix, iy) + dy * texel(ix, iy + 1)) + dx * ((1 - dy) * texel(ix + 1, iy) + dy * texel(ix + 1, iy + 1));
+    }
+};
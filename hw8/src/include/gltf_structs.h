@@ -4,13 +4,8 @@
 #include <vector>
 #include "transition.h"
 #include "material.h"
-
-using Buffer = std::vector<char>;
-
-struct Texture {
-    int width, height;
-    uint8_t *data;
-};
+#include "texture.h"
+#include "buffer.h"
 
 struct TextureDesc {
     size_t sampler;
@@ -21,6 +16,8 @@ struct BufferView {
     size_t buffer;
     size_t byteLength;
     size_t byteOffset;
+    // 0 when elements are tightly packed
+    size_t byteStride;
 };
 
 struct Node {
@@ -65,4 +62,6 @@ struct Accessor {
     std::size_t componentType;
     std::string type;
     std::size_t byteOffset;
+    // Integer components map to [0, 1] (unsigned) or [-1, 1] (signed) instead of their value
+    bool normalized;
 };
\ No newline at end of file
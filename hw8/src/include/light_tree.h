@@ -0,0 +1,224 @@
+#pragma once
+#include "vec3.h"
+#include "primitives.h"
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+/**
+ * Bounds of a set of emitters: box, total power and a cone containing their normals.
+ * Emitters are two-sided, so a normal and its opposite are interchangeable.
+ */
+struct LightBounds {
+    AABB bounds;
+    Vec3 w;
+    float cosTheta = 1;
+    float phi = 0;
+
+    LightBounds() {}
+    LightBounds(const AABB &bounds, const Vec3 &w, float cosTheta, float phi): bounds(bounds), w(w), cosTheta(cosTheta), phi(phi) {}
+
+    static LightBounds merge(const LightBounds &a, const LightBounds &b) {
+        if (a.phi == 0) {
+            return b;
+        }
+        if (b.phi == 0) {
+            return a;
+        }
+        AABB bounds = a.bounds;
+        bounds.extend(b.bounds);
+        Vec3 bw = a.w.dot(b.w) < 0 ? -1.f * b.w : b.w;
+
+        // Smallest cone containing both cones
+        float thetaA = safeAcos(a.cosTheta), thetaB = safeAcos(b.cosTheta);
+        float thetaD = safeAcos(a.w.dot(bw));
+        Vec3 w;
+        float cosTheta;
+        if (std::min<float>(thetaD + thetaB, M_PI) <= thetaA) {
+            w = a.w;
+            cosTheta = a.cosTheta;
+        } else if (std::min<float>(thetaD + thetaA, M_PI) <= thetaB) {
+            w = bw;
+            cosTheta = b.cosTheta;
+        } else {
+            float thetaO = 0.5f * (thetaA + thetaD + thetaB);
+            Vec3 perp = bw - a.w.dot(bw) * a.w;
+            if (thetaO >= M_PI || perp.len2() == 0) {
+                w = a.w;
+                cosTheta = -1;
+            } else {
+                float thetaR = thetaO - thetaA;
+                w = (std::cos(thetaR) * a.w + std::sin(thetaR) * perp.normalize()).normalize();
+                cosTheta = std::cos(thetaO);
+            }
+        }
+        return LightBounds(bounds, w, cosTheta, a.phi + b.phi);
+    }
+
+    /**
+     * Conservative estimate of the contribution to a point x with normal n,
+     * after Conty & Kulla, "Importance Sampling of Many Lights with Adaptive Tree Splitting".
+     */
+    float importance(const Vec3 &x, const Vec3 &n) const {
+        Vec3 center = 0.5f * (bounds.min + bounds.max);
+        Vec3 toPoint = x - center;
+        float d2 = std::max(toPoint.len2(), 0.5f * (bounds.max - bounds.min).len());
+        Vec3 wi = toPoint.normalize();
+
+        float cosThetaW = std::fabs(w.dot(wi));
+        float sinThetaW = safeSqrt(1 - cosThetaW * cosThetaW);
+
+        // Cone of directions from x towards the bounding sphere of the box
+        float radius2 = 0.25f * (bounds.max - bounds.min).len2();
+        float cosThetaB = -1;
+        if (toPoint.len2() > radius2) {
+            cosThetaB = safeSqrt(1 - radius2 / toPoint.len2());
+        }
+        float sinThetaB = safeSqrt(1 - cosThetaB * cosThetaB);
+
+        // cos(max(0, thetaW - thetaO - thetaB))
+        float sinThetaO = safeSqrt(1 - cosTheta * cosTheta);
+        float cosThetaX = cosSubClamped(sinThetaW, cosThetaW, sinThetaO, cosTheta);
+        float sinThetaX = sinSubClamped(sinThetaW, cosThetaW, sinThetaO, cosTheta);
+        float cosThetaP = cosSubClamped(sinThetaX, cosThetaX, sinThetaB, cosThetaB);
+        if (cosThetaP <= 0) {
+            return 0;
+        }
+
+        float cosThetaI = std::fabs(wi.dot(n));
+        float sinThetaI = safeSqrt(1 - cosThetaI * cosThetaI);
+        float cosThetaPI = cosSubClamped(sinThetaI, cosThetaI, sinThetaB, cosThetaB);
+        return std::max(0.f, phi * cosThetaP * cosThetaPI / d2);
+    }
+
+private:
+    static float safeSqrt(float x) {
+        return std::sqrt(std::max(0.f, x));
+    }
+
+    static float safeAcos(float x) {
+        return std::acos(std::clamp(x, -1.f, 1.f));
+    }
+
+    static float cosSubClamped(float sinA, float cosA, float sinB, float cosB) {
+        return cosA > cosB ? 1 : cosA * cosB + sinA * sinB;
+    }
+
+    static float sinSubClamped(float sinA, float cosA, float sinB, float cosB) {
+        return cosA > cosB ? 0 : sinA * cosB - cosA * sinB;
+    }
+};
+
+/**
+ * Binary tree over emitters, traversed stochastically proportionally to LightBounds::importance.
+ * Every light remembers its root-to-leaf path as a bit trail, so its selection
+ * probability for a given shading point can be recomputed in O(depth).
+ */
+class LightTree {
+private:
+    struct Node {
+        LightBounds lightBounds;
+        uint32_t left = 0, right = 0;
+        uint32_t light = 0;
+        bool isLeaf = false;
+    };
+
+    std::vector<Node> nodes;
+    std::vector<uint64_t> bitTrails;
+
+    uint32_t build(std::vector<std::pair<uint32_t, LightBounds>> &lights, uint32_t first, uint32_t last, uint64_t bitTrail, int depth) {
+        uint32_t pos = nodes.size();
+        nodes.emplace_back();
+        if (last - first == 1) {
+            nodes[pos].lightBounds = lights[first].second;
+            nodes[pos].light = lights[first].first;
+            nodes[pos].isLeaf = true;
+            bitTrails[lights[first].first] = bitTrail;
+            return pos;
+        }
+
+        AABB centroids(lights[first].second.bounds.min + lights[first].second.bounds.max, lights[first].second.bounds.min + lights[first].second.bounds.max);
+        for (uint32_t i = first + 1; i < last; i++) {
+            centroids.extend(lights[i].second.bounds.min + lights[i].second.bounds.max);
+        }
+        Vec3 extent = centroids.max - centroids.min;
+        int axis = extent.x > extent.y && extent.x > extent.z ? 0 : (extent.y > extent.z ? 1 : 2);
+        auto key = [axis](const std::pair<uint32_t, LightBounds> &light) {
+            Vec3 c = light.second.bounds.min + light.second.bounds.max;
+            return axis == 0 ? c.x : (axis == 1 ? c.y : c.z);
+        };
+        uint32_t mid = (first + last) / 2;
+        std::nth_element(lights.begin() + first, lights.begin() + mid, lights.begin() + last, [&key](const auto &lhs, const auto &rhs) {
+            return key(lhs) < key(rhs);
+        });
+
+        uint32_t left = build(lights, first, mid, bitTrail, depth + 1);
+        uint32_t right = build(lights, mid, last, bitTrail | (1ull << depth), depth + 1);
+        nodes[pos].left = left;
+        nodes[pos].right = right;
+        nodes[pos].lightBounds = LightBounds::merge(nodes[left].lightBounds, nodes[right].lightBounds);
+        return pos;
+    }
+
+    // Probability of descending into the left child; an even split when both look unimportant
+    float leftProbability(const Node &node, const Vec3 &x, const Vec3 &n) const {
+        float left = nodes[node.left].lightBounds.importance(x, n);
+        float right = nodes[node.right].lightBounds.importance(x, n);
+        if (left + right == 0) {
+            return 0.5f;
+        }
+        return left / (left + right);
+    }
+
+public:
+    LightTree() {}
+
+    LightTree(const std::vector<LightBounds> &lightBounds): bitTrails(lightBounds.size()) {
+        std::vector<std::pair<uint32_t, LightBounds>> lights;
+        for (uint32_t i = 0; i < lightBounds.size(); i++) {
+            lights.push_back({i, lightBounds[i]});
+        }
+        if (!lights.empty()) {
+            build(lights, 0, lights.size(), 0, 0);
+        }
+    }
+
+    template <typename Archive>
+    void serialize(Archive &archive) {
+        archive.array(nodes);
+        archive.array(bitTrails);
+    }
+
+    uint32_t sample(float u, const Vec3 &x, const Vec3 &n) const {
+        const Node *node = &nodes[0];
+        while (!node->isLeaf) {
+            float pLeft = leftProbability(*node, x, n);
+            if (u < pLeft) {
+                u = std::min(u / pLeft, 0x1.fffffep-1f);
+                node = &nodes[node->left];
+            } else {
+                u = std::min((u - pLeft) / (1 - pLeft), 0x1.fffffep-1f);
+                node = &nodes[node->right];
+            }
+        }
+        return node->light;
+    }
+
+    float pdf(uint32_t light, const Vec3 &x, const Vec3 &n) const {
+        uint64_t bitTrail = bitTrails[light];
+        const Node *node = &nodes[0];
+        float result = 1;
+        while (!node->isLeaf) {
+            float pLeft = leftProbability(*node, x, n);
+            if (bitTrail & 1) {
+                result *= 1 - pLeft;
+                node = &nodes[node->right];
+            } else {
+                result *= pLeft;
+                node = &nodes[node->left];
+            }
+            bitTrail >>= 1;
+        }
+        return result;
+    }
+};
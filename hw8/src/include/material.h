@@ -1,66 +1,112 @@
 #pragma once
 
+#include <algorithm>
+#include <cmath>
 #include "vec3.h"
+#include "color.h"
+#include "simd.h"
+#include "shading.h"
 
 class MaterialModel {
 private:
     float baseMetallic;
     Color baseColor;
 
-public:    
-    float distributionTerm(const Vec3 &h, const Vec3 &n, float alpha2) const {
-        float dotHN = h.dot(n);
+public:
+    float distributionTerm(float dotHN, float alpha2) const {
         if (dotHN <= 0) {
             return 0;
         }
-        return alpha2 / (M_PI * pow(std::max(0.f, (alpha2 - 1) * dotHN * dotHN + 1), 2.0));
+        float k = std::max(0.f, (alpha2 - 1) * dotHN * dotHN + 1);
+        return alpha2 / ((float) M_PI * k * k);
     }
 
-    float v1(const Vec3 &n, const Vec3 &x, float alpha2) const {
-        return 1. / (fabs(n.dot(x)) + sqrt(std::max(0.f, alpha2 + (1 - alpha2) * n.dot(x) * n.dot(x))));
+    float v1(float dotNX, float alpha2) const {
+        return 1.f / (std::fabs(dotNX) + std::sqrt(std::max(0.f, alpha2 + (1 - alpha2) * dotNX * dotNX)));
     }
 
-    float specularBrdf(const Vec3 &l, const Vec3 &v, const Vec3 &n, float alpha2) const {
-        Vec3 h = (l + v).normalize();
-        if (h.dot(l) < 1e-4 || h.dot(v) < 1e-4) {
+    float specularBrdf(float dotHL, float dotHV, float dotHN, float dotLN, float dotVN, float alpha2) const {
+        if (dotHL < 1e-4f || dotHV < 1e-4f) {
             return 0;
         }
-        return distributionTerm(h, n, alpha2) * v1(n, l, alpha2) * v1(n, v, alpha2);
+        return distributionTerm(dotHN, alpha2) * v1(dotLN, alpha2) * v1(dotVN, alpha2);
+    }
+
+    Float4 diffuseBrdf(Float4 color) const {
+        return Float4(1.f / (float) M_PI) * color;
     }
 
-    Vec3 diffuseBrdf(const Color &color) const {
-        return (1. / M_PI) * color;
+    // Schlick's weight of f90 against f0
+    float fresnelWeight(float dotVH) const {
+        float k = std::max(0.f, 1.f - std::fabs(dotVH));
+        float k2 = k * k;
+        return k2 * k2 * k;
     }
 
-    Vec3 fresnelTerm(const Vec3 &f0, const Vec3 &f90, const Vec3 &v, const Vec3 &h) const {
-        return f0 + pow(std::max<float>(0.f, 1.f - fabs(v.dot(h))), 5.0) * (f90 - f0);
+    Float4 fresnelTerm(Float4 f0, Float4 f90, float weight) const {
+        return f0 + Float4(weight) * (f90 - f0);
     }
 
 public:
     MaterialModel(float metallic, Color baseColor): baseMetallic(metallic), baseColor(baseColor) {}
 
-    Vec3 brdf(const Vec3 &l, const Vec3 &v, const Vec3 &n, const Color& color, float metallic, float alpha) const {
-        Vec3 h = (l + v).normalize();
-        // if (v.dot(n) < 0 || l.dot(n) < 0) {
+    // Parameters of a point of this material given its texture lookups
+    Color albedo(const Color &texel) const {
+        return baseColor * texel;
+    }
+
+    float metallic(float texel) const {
+        return baseMetallic * texel;
+    }
+
+    /**
+     * Fraction of the light reflected towards the viewer that the specular lobe carries, by
+     * Schlick's Fresnel at the view angle, for choosing between the lobes when sampling. Kept
+     * within [MIN_LOBE_SHARE, 1 - MIN_LOBE_SHARE] so neither lobe goes unsampled.
+     */
+    float specularShare(const ShadingPoint &point) const {
+        static constexpr float MIN_LOBE_SHARE = 0.1f;
+        float weight = fresnelWeight(point.localV.z);
+        float albedo = luminance(point.albedo);
+        float dielectric = 0.04f + weight * (1 - 0.04f);
+        float specular = point.metallic * (albedo + weight * (1 - albedo)) + (1 - point.metallic) * dielectric;
+        float diffuse = (1 - point.metallic) * (1 - dielectric) * albedo;
+        // A black metal reflects nothing, and either lobe serves as well as the other
+        if (!(specular + diffuse > 0)) {
+            return 0.5f;
+        }
+        return std::clamp(specular / (specular + diffuse), MIN_LOBE_SHARE, 1 - MIN_LOBE_SHARE);
+    }
+
+    // Works in the local frame of the point, where the normal is z and the half vector is found once
+    Vec3 brdf(const ShadingPoint &point, const Vec3 &l_) const {
+        Vec3 l = point.toLocal(l_);
+        const Vec3 &v = point.localV;
+        Vec3 h = fastNormalize(l + v);
+        float dotHL = h.dot(l), dotHV = h.dot(v);
+        float dotLN = l.z, dotVN = v.z;
+        // if (dotVN < 0 || dotLN < 0) {
         //     return {0, 0, 0};
         // }
-        float specular = specularBrdf(l, v, n, alpha * alpha);
+        float specular = specularBrdf(dotHL, dotHV, h.z, dotLN, dotVN, point.alpha2);
+        float weight = fresnelWeight(dotHV);
+        Float4 albedo(point.albedo);
 
-        Vec3 metalBrdf, dieletricBrdf;
-        metallic *= baseMetallic;
-        if (metallic > 0 && v.dot(n) >= 0 && l.dot(n) >= 0) {
-            auto ft = fresnelTerm(baseColor * color, {1, 1, 1}, v, h);
-            metalBrdf = specular * ft;
+        Float4 result(0.f);
+        float metallic = point.metallic;
+        if (metallic > 0 && dotVN >= 0 && dotLN >= 0) {
+            Float4 ft = fresnelTerm(albedo, Float4(1.f), weight);
+            result = Float4(metallic * specular) * ft;
         }
         if (metallic < 1) {
-            Vec3 diffuse;
-            if (/*v.dot(n) >= 0 && */l.dot(n) >= 0) {
-                diffuse = diffuseBrdf(baseColor * color);
+            Float4 diffuse(0.f);
+            if (/*dotVN >= 0 && */dotLN >= 0) {
+                diffuse = diffuseBrdf(albedo);
             }
-            Vec3 ft = fresnelTerm({0.04, 0.04, 0.04}, {1, 1, 1}, v, h);
-            dieletricBrdf = diffuse * (Vec3{1, 1, 1} - ft) + specular * ft;
+            float ft = 0.04f + weight * (1 - 0.04f);
+            Float4 dieletricBrdf = diffuse * Float4(1 - ft) + Float4(specular * ft);
+            result = result + Float4(1 - metallic) * dieletricBrdf;
         }
-
-        return (1.0 - metallic) * dieletricBrdf + metallic * metalBrdf;
+        return result.vec3();
     }
-};
\ No newline at end of file
+};
@@ -1,12 +1,15 @@
 #pragma once
+#include <cmath>
+#include <cstdint>
 #include <optional>
 #include <cassert>
 #include "vec3.h"
+#include "simd.h"
 #include "color.h"
 #include "quaternion.h"
 #include "gltf_structs.h"
 
-const long double eps = 1e-4;
+const float eps = 1e-4f;
 
 struct Vec2 {
     float x, y;
@@ -23,20 +26,78 @@ struct Vec4 {
     Vec4(Vec3 v, float w): v(v), w(w) {}
 };
 
+// Octahedral parameterization of the sphere (y up) onto [0, 1]^2: direction <-> texcoords without trigonometry
+inline Vec2 octahedralEncode(const Vec3 &d) {
+    float l1 = std::fabs(d.x) + std::fabs(d.y) + std::fabs(d.z);
+    float px = d.x / l1, pz = d.z / l1;
+    if (d.y < 0) {
+        float fx = (1 - std::fabs(pz)) * (px < 0 ? -1.f : 1.f);
+        float fz = (1 - std::fabs(px)) * (pz < 0 ? -1.f : 1.f);
+        px = fx;
+        pz = fz;
+    }
+    return Vec2(0.5f * px + 0.5f, 0.5f * pz + 0.5f);
+}
+
+inline Vec3 octahedralDecode(float u, float v) {
+    float px = 2 * u - 1, pz = 2 * v - 1;
+    float py = 1 - std::fabs(px) - std::fabs(pz);
+    if (py < 0) {
+        float fx = (1 - std::fabs(pz)) * (px < 0 ? -1.f : 1.f);
+        float fz = (1 - std::fabs(px)) * (pz < 0 ? -1.f : 1.f);
+        px = fx;
+        pz = fz;
+    }
+    return Vec3(px, py, pz).normalize();
+}
+
+// Unit vector as its octahedral texcoords in 16-bit fixed point, error below 1e-4 rad
+struct PackedDirection {
+    uint16_t u, v;
+
+    PackedDirection() {}
+    PackedDirection(const Vec3 &d) {
+        // A degenerate vector packs as +y rather than NaN
+        Vec2 uv = std::fabs(d.x) + std::fabs(d.y) + std::fabs(d.z) > 0 ? octahedralEncode(d) : Vec2(0.5f, 0.5f);
+        u = std::lround(std::fmin(std::fmax(uv.x, 0.f), 1.f) * 65535);
+        v = std::lround(std::fmin(std::fmax(uv.y, 0.f), 1.f) * 65535);
+    }
+
+    Vec3 unpack() const {
+        return octahedralDecode(u / 65535.f, v / 65535.f);
+    }
+};
+
+/**
+ * Positions and texcoords stay in floats, shading directions are packed (32 bytes instead of 48),
+ * which keeps figures of large and quantized meshes compact.
+ */
 class Vertex {
+private:
+    PackedDirection normal_;
+    PackedDirection tangent_;
+
 public:
     Vec3 coords;
     Vec2 texcoords;
-    Vec3 normals;
-    Vec4 tangents;
+    float tangentSign;
 
     Vertex() {}
-    Vertex(Vec3 coords, Vec2 texcoords, Vec3 normals, Vec4 tangents): coords(coords), texcoords(texcoords), normals(normals), tangents(tangents) {}
+    Vertex(Vec3 coords, Vec2 texcoords, Vec3 normals, Vec4 tangents)
+        : normal_(normals), tangent_(tangents.v), coords(coords), texcoords(texcoords), tangentSign(tangents.w) {}
+
+    Vec3 normal() const {
+        return normal_.unpack();
+    }
+
+    Vec4 tangent() const {
+        return Vec4(tangent_.unpack(), tangentSign);
+    }
 };
 
 class Ray {
 public:
-    const Vec3 o, d;
+    Vec3 o, d;
 
     Ray();
     Ray(Vec3 o, Vec3 d);
@@ -46,6 +107,24 @@ public:
     Ray rotate(const Quaternion &rotation) const;
 };
 
+// A ray loaded into SIMD registers once per traversal, with the reciprocal direction for the box tests
+struct PreparedRay {
+    Float4 o, d, invD;
+
+    PreparedRay(const Ray &ray): o(ray.o), d(ray.d), invD(rcp(d)) {}
+};
+
+struct BoxHit {
+    float t;
+    bool isInside;
+};
+
+// Where a ray crosses a triangle; the shading attributes are interpolated only for the closest one
+struct TriangleHit {
+    float t, u, v;
+    bool isInside;
+};
+
 struct Intersection {
     float t;
     Vec3 geomNorma;
@@ -56,9 +135,6 @@ struct Intersection {
 };
 
 class Figure {
-private:
-    std::optional<Intersection> intersectAsTriangle(const Ray &ray) const;
-
 public:
     size_t materialIndex;
     GltfMaterial material;
@@ -71,6 +147,8 @@ public:
     Figure(Vertex data);
     Figure(Vertex data, Vertex data2, Vertex data3);
 
+    std::optional<TriangleHit> hit(const PreparedRay &ray) const;
+    Intersection interpolate(const TriangleHit &hit) const;
     std::optional<Intersection> intersect(const Ray &ray) const;
 };
 
@@ -87,7 +165,20 @@ public:
     void extend(const AABB &aabb);
     float getS() const;
 
-    std::optional<Intersection> intersect(const Ray &ray) const;
+    std::optional<BoxHit> intersect(const PreparedRay &ray) const {
+        // Slab test on all three axes at once; the w lanes are ignored by hmax3 and hmin3
+        Float4 lo = (Float4(this->min) - ray.o) * ray.invD;
+        Float4 hi = (Float4(this->max) - ray.o) * ray.invD;
+        float t1 = hmax3(::min(lo, hi)).x();
+        float t2 = hmin3(::max(lo, hi)).x();
+        if (t1 > t2 || t2 < 0) {
+            return {};
+        }
+        if (t1 < 0) {
+            return {BoxHit {t2, true}};
+        }
+        return {BoxHit {t1, false}};
+    }
 };
 
 
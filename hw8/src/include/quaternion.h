@@ -38,11 +38,11 @@ inline Quaternion Quaternion::operator * (const Quaternion &other) const {
 }
 
 inline Quaternion Quaternion::conjugate() const {
-    return {(-1.) * v, w};
+    return {-v, w};
 }
 
 inline Vec3 Quaternion::transform(const Vec3 &p) const {
-    return ((*this) * Quaternion(p.x, p.y, p.z, 0.) * conjugate()).v;
+    return ((*this) * Quaternion(p.x, p.y, p.z, 0.f) * conjugate()).v;
 }
 
 inline std::istream &operator >> (std::istream &in, Quaternion &q) {
@@ -0,0 +1,199 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <optional>
+#include <string_view>
+
+enum class SamplerType {
+    Random, Sobol, Halton
+};
+
+inline std::optional<SamplerType> samplerTypeFromString(std::string_view name) {
+    if (name == "random") {
+        return SamplerType::Random;
+    }
+    if (name == "sobol") {
+        return SamplerType::Sobol;
+    }
+    if (name == "halton") {
+        return SamplerType::Halton;
+    }
+    return {};
+}
+
+/**
+ * Sample generator keyed on (pixel, sample index, dimension), so an image does not depend
+ * on the number of threads or on the order pixels are rendered in.
+ *
+ * Dimensions are laid out per path vertex: the first PIXEL_DIMENSIONS go to the camera ray,
+ * then every bounce starts at its own block of DIMENSIONS_PER_BOUNCE, so strategies consume
+ * the same dimensions regardless of what earlier bounces drew.
+ *
+ * Random hashes every dimension independently. Sobol is Burley's shuffled Owen-scrambled
+ * Sobol, padded in 4D groups with an independent index shuffle per group. Halton uses a
+ * per-pixel nested digit scrambling of the radical inverse and falls back to Random after
+ * the last tabulated prime.
+ */
+class Sampler {
+public:
+    static constexpr uint32_t PIXEL_DIMENSIONS = 4;
+    static constexpr uint32_t DIMENSIONS_PER_BOUNCE = 8;
+
+private:
+    static constexpr std::array<uint32_t, 64> PRIMES = {
+        2, 3, 5, 7, 11, 13, 17, 19, 23, 29, 31, 37, 41, 43, 47, 53,
+        59, 61, 67, 71, 73, 79, 83, 89, 97, 101, 103, 107, 109, 113, 127, 131,
+        137, 139, 149, 151, 157, 163, 167, 173, 179, 181, 191, 193, 197, 199, 211, 223,
+        227, 229, 233, 239, 241, 251, 257, 263, 269, 271, 277, 281, 283, 293, 307, 311
+    };
+
+    SamplerType type;
+    uint64_t pixelKey;
+    uint32_t pixelSeed;
+    uint32_t index = 0;
+    uint64_t seed = 0;
+    uint32_t dimension = 0;
+
+    uint32_t sobolGroup = UINT32_MAX;
+    std::array<float, 4> sobolPoint;
+
+    static uint64_t mix(uint64_t x) {
+        // splitmix64 finalizer
+        x ^= x >> 30;
+        x *= 0xbf58476d1ce4e5b9ull;
+        x ^= x >> 27;
+        x *= 0x94d049bb133111ebull;
+        x ^= x >> 31;
+        return x;
+    }
+
+    static uint32_t hashCombine(uint32_t seed, uint32_t v) {
+        return seed ^ (v + (seed << 6) + (seed >> 2));
+    }
+
+    static uint32_t reverseBits(uint32_t x) {
+        x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+        x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+        x = ((x >> 4) & 0x0f0f0f0fu) | ((x & 0x0f0f0f0fu) << 4);
+        x = ((x >> 8) & 0x00ff00ffu) | ((x & 0x00ff00ffu) << 8);
+        return (x >> 16) | (x << 16);
+    }
+
+    static uint32_t laineKarrasPermutation(uint32_t x, uint32_t seed) {
+        x += seed;
+        x ^= x * 0x6c50b47cu;
+        x ^= x * 0xb82f1e52u;
+        x ^= x * 0xc7afe638u;
+        x ^= x * 0x8d22f6e6u;
+        return x;
+    }
+
+    static uint32_t nestedUniformScramble(uint32_t x, uint32_t seed) {
+        return reverseBits(laineKarrasPermutation(reverseBits(x), seed));
+    }
+
+    static const std::array<std::array<uint32_t, 32>, 4> &sobolMatrices() {
+        // Joe & Kuo direction numbers for the first four dimensions: (s, a, m...)
+        static const auto matrices = []() {
+            const uint32_t s[4] = {0, 1, 2, 3};
+            const uint32_t a[4] = {0, 0, 1, 1};
+            const uint32_t m[4][3] = {{}, {1}, {1, 3}, {1, 3, 1}};
+            std::array<std::array<uint32_t, 32>, 4> result;
+            for (int i = 0; i < 32; i++) {
+                result[0][i] = 1u << (31 - i);
+            }
+            for (int d = 1; d < 4; d++) {
+                auto &v = result[d];
+                for (uint32_t i = 0; i < s[d]; i++) {
+                    v[i] = m[d][i] << (31 - i);
+                }
+                for (uint32_t i = s[d]; i < 32; i++) {
+                    v[i] = v[i - s[d]] ^ (v[i - s[d]] >> s[d]);
+                    for (uint32_t k = 1; k < s[d]; k++) {
+                        v[i] ^= ((a[d] >> (s[d] - 1 - k)) & 1) * v[i - k];
+                    }
+                }
+            }
+            return result;
+        }();
+        return matrices;
+    }
+
+    static float toFloat(uint32_t x) {
+        return (x >> 8) * 0x1p-24f;
+    }
+
+    float random(uint32_t dim) const {
+        uint64_t h = mix(seed ^ (0x9e3779b97f4a7c15ull * (dim + 1)));
+        return (h >> 40) * 0x1p-24f;
+    }
+
+    float sobol(uint32_t dim) {
+        uint32_t group = dim / 4;
+        if (group != sobolGroup) {
+            sobolGroup = group;
+            uint32_t groupSeed = static_cast<uint32_t>(mix(hashCombine(pixelSeed, group)));
+            uint32_t shuffled = nestedUniformScramble(index, groupSeed);
+            const auto &matrices = sobolMatrices();
+            for (int d = 0; d < 4; d++) {
+                uint32_t x = 0;
+                for (uint32_t bits = shuffled, bit = 0; bits != 0; bits >>= 1, bit++) {
+                    if (bits & 1) {
+                        x ^= matrices[d][bit];
+                    }
+                }
+                sobolPoint[d] = toFloat(nestedUniformScramble(x, hashCombine(groupSeed, d + 1)));
+            }
+        }
+        return sobolPoint[dim % 4];
+    }
+
+    float halton(uint32_t dim) const {
+        if (dim >= PRIMES.size()) {
+            return random(dim);
+        }
+        uint32_t base = PRIMES[dim];
+        uint32_t dimSeed = static_cast<uint32_t>(mix(hashCombine(pixelSeed, dim)));
+        float invBase = 1.f / base, invBaseM = 1.f;
+        uint64_t reversedDigits = 0;
+        uint32_t a = index;
+        for (uint32_t digitIndex = 0; 1.f - invBaseM < 1.f; digitIndex++) {
+            uint32_t next = a / base;
+            uint32_t digit = a - next * base;
+            uint32_t digitHash = static_cast<uint32_t>(mix(dimSeed ^ (reversedDigits << 8) ^ digitIndex));
+            digit = (digit + digitHash % base) % base;
+            reversedDigits = reversedDigits * base + digit;
+            invBaseM *= invBase;
+            a = next;
+        }
+        return std::min(invBaseM * reversedDigits, 0x1.fffffep-1f);
+    }
+
+public:
+    Sampler(SamplerType type, uint32_t pixel)
+        : type(type), pixelKey(static_cast<uint64_t>(pixel) << 32), pixelSeed(static_cast<uint32_t>(mix(pixel))) {}
+
+    void startSample(uint32_t sampleIndex) {
+        index = sampleIndex;
+        seed = mix(pixelKey | sampleIndex);
+        dimension = 0;
+        sobolGroup = UINT32_MAX;
+    }
+
+    void startBounce(uint32_t bounce) {
+        dimension = PIXEL_DIMENSIONS + bounce * DIMENSIONS_PER_BOUNCE;
+    }
+
+    float get1D() {
+        uint32_t dim = dimension++;
+        switch (type) {
+        case SamplerType::Sobol:
+            return sobol(dim);
+        case SamplerType::Halton:
+            return halton(dim);
+        default:
+            return random(dim);
+        }
+    }
+};
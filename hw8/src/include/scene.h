@@ -5,22 +5,43 @@
 #include "distributions.h"
 #include "bvh.h"
 #include "gltf_structs.h"
+#include "texture_cache.h"
+#include <cmath>
 #include <string>
+#include <string_view>
+#include <optional>
 #include <vector>
 #include <memory>
-#include <random>
+#include "sampler.h"
 
-typedef std::minstd_rand rng_type;
+enum class Integrator {
+    Mix, Nee
+};
+
+inline std::optional<Integrator> integratorFromString(std::string_view name) {
+    if (name == "mix") {
+        return Integrator::Mix;
+    }
+    if (name == "nee") {
+        return Integrator::Nee;
+    }
+    return {};
+}
 
 class Scene {
 private:
-    Mix distribution;
+    // One mixture type per combination of light sources, chosen once when the scene is set up
+    SceneDistribution distribution;
 
     Ray getCameraRay(float x, float y) const;
     std::optional<std::pair<Intersection, int>> intersect(const Ray &ray) const;
-    Color getColor(std::uniform_real_distribution<float> &u01, std::normal_distribution<float> &n01, rng_type &rng, const Ray &ray, int recLimit);
+    Vec3 getEmission(const Intersection &intersection, int figurePos, float lod = -INFINITY) const;
+    Color getEnvironment(Vec3 d) const;
+    template <typename Distribution>
+    Color getColor(Sampler &sampler, Ray ray, const Distribution &distribution) const;
 
 public:
+    // Raw glTF tables, released once loading has converted them
     std::vector<Buffer> buffers;
     std::vector<BufferView> bufferViews;
     std::vector<Node> nodes;
@@ -29,22 +50,40 @@ public:
     std::vector<GltfMaterial> materials;
     std::vector<MaterialModel> materialModels;
     int samples;
+    // Sample indices drawn per pixel start here, so two renders can use disjoint sample sequences
+    uint32_t firstSample = 0;
     int rayDepth = 6;
+    SamplerType samplerType = SamplerType::Sobol;
+    // Mix draws one direction per vertex from all strategies, Nee adds a shadow ray per vertex
+    Integrator integrator = Integrator::Mix;
     int width, height;
     Color bgColor;
     Vec3 cameraPos, cameraUp, cameraRight, cameraForward;
     float cameraFovY;
-    std::vector<Figure> figures;
+    std::optional<size_t> cameraNode;
+    std::vector<float> cameraYFovs;
+    Storage<Figure> figures;
     BVH bvh;
-    std::optional<Texture> environmentMap;
+    std::optional<EnvironmentMap> environmentMap;
     std::vector<TextureDesc> textureDescs;
-    std::vector<Texture> textureImages;
+    TextureCache textureCache;
 
     Scene();
 
-    Color getPixel(rng_type &rng, int x, int y);
+    Color getPixel(int x, int y);
     void initDistribution();
-    void initBVH();
+    // Mixes the BSDF strategies with already built emitter lights and the environment, if any
+    void setDistribution(FiguresMix lightDistribution);
+    // Resamples an equirectangular image onto the octahedral grid
+    static EnvironmentMap toEnvironmentMap(const Texture &texture);
+    // Converts an equirectangular image, then adds it to the light sampling strategies
+    void setEnvironmentMap(const Texture &texture);
+    // Replaces the environment, or removes it with nullopt, keeping the emitter strategy as built
+    void setEnvironmentMap(std::optional<EnvironmentMap> map);
+    // Permutes figures so that order[newIndex] == oldIndex, keeping the light distribution in step
+    void reorderFigures(const std::vector<uint32_t> &order);
 
-    ~Scene();
+    // Reads or writes everything loading produces, see scene_cache.h
+    template <typename Archive>
+    void serialize(Archive &archive);
 };
\ No newline at end of file
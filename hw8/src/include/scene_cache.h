@@ -0,0 +1,163 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <type_traits>
+#include <vector>
+#include "buffer.h"
+#include "storage.h"
+
+class Scene;
+
+/**
+ * Binary snapshot of a loaded scene: flattened figures, the scene BVH, the emitter light tree,
+ * materials, cameras and every texture fully decoded into cache pages.
+ *
+ * The file is a header followed by records, each an element count and size, then the elements
+ * aligned to 64 bytes. Classes describe their fields once, in a serialize(Archive &) template that
+ * CacheWriter and CacheReader both drive. Reading maps the file read-only, and large arrays
+ * (Storage members and texture pages) are used in place, so renders of one scene share its pages.
+ */
+namespace scene_cache {
+
+// Bumped whenever the meaning of a serialized field changes; element sizes are checked on their own
+static const uint32_t VERSION = 4;
+
+uint64_t hashBytes(const char *data, size_t size, uint64_t seed);
+
+// False, with the scene untouched, if the file is missing, stale or damaged
+bool load(const std::string &path, uint64_t key, Scene &scene);
+bool save(const std::string &path, uint64_t key, Scene &scene);
+
+}
+
+class CacheWriter {
+private:
+    std::ofstream &out;
+    size_t offset;
+
+    void write(const void *data, size_t size) {
+        out.write(static_cast<const char*>(data), size);
+        offset += size;
+    }
+
+    void align() {
+        static const char zeros[64] = {};
+        write(zeros, (64 - offset % 64) % 64);
+    }
+
+public:
+    static constexpr bool WRITING = true;
+
+    CacheWriter(std::ofstream &out, size_t offset): out(out), offset(offset) {}
+
+    template <typename T>
+    void array(const T *data, size_t count) {
+        static_assert(std::is_trivially_copyable_v<T>);
+        uint64_t header[2] = {count, sizeof(T)};
+        write(header, sizeof(header));
+        align();
+        write(data, count * sizeof(T));
+    }
+
+    template <typename T>
+    void array(const std::vector<T> &v) {
+        array(v.data(), v.size());
+    }
+
+    template <typename T>
+    void array(const Storage<T> &v) {
+        array(v.data(), v.size());
+    }
+
+    template <typename T>
+    void value(const T &v) {
+        array(&v, 1);
+    }
+
+    void fail() {}
+
+    bool ok() const {
+        return out.good();
+    }
+
+    size_t size() const {
+        return offset;
+    }
+};
+
+class CacheReader {
+private:
+    Buffer file;
+    size_t offset;
+    bool ok_ = true;
+
+    // The next record if it holds elements of elementSize bytes, as a slice of the file
+    Buffer next(size_t elementSize, size_t &count) {
+        count = 0;
+        uint64_t header[2];
+        if (!ok_ || offset + sizeof(header) > file.size()) {
+            ok_ = false;
+            return Buffer();
+        }
+        std::memcpy(header, file.data() + offset, sizeof(header));
+        offset += sizeof(header);
+        offset += (64 - offset % 64) % 64;
+        if (header[1] != elementSize || offset > file.size() || header[0] > (file.size() - offset) / elementSize) {
+            ok_ = false;
+            return Buffer();
+        }
+        count = header[0];
+        Buffer result = file.slice(offset, count * elementSize);
+        offset += count * elementSize;
+        return result;
+    }
+
+public:
+    static constexpr bool WRITING = false;
+
+    CacheReader(const Buffer &file, size_t offset): file(file), offset(offset) {}
+
+    template <typename T>
+    void array(std::vector<T> &v) {
+        static_assert(std::is_trivially_copyable_v<T>);
+        size_t count;
+        Buffer bytes = next(sizeof(T), count);
+        const T *data = reinterpret_cast<const T*>(bytes.data());
+        v = std::vector<T>(data, data + count);
+    }
+
+    template <typename T>
+    void array(Storage<T> &v) {
+        static_assert(std::is_trivially_copyable_v<T>);
+        size_t count;
+        Buffer bytes = next(sizeof(T), count);
+        v = Storage<T>(bytes, count);
+    }
+
+    void array(Buffer &bytes) {
+        size_t count;
+        bytes = next(1, count);
+    }
+
+    template <typename T>
+    void value(T &v) {
+        static_assert(std::is_trivially_copyable_v<T>);
+        size_t count;
+        Buffer bytes = next(sizeof(T), count);
+        if (count != 1) {
+            ok_ = false;
+            return;
+        }
+        std::memcpy(static_cast<void*>(&v), bytes.data(), sizeof(T));
+    }
+
+    void fail() {
+        ok_ = false;
+    }
+
+    bool ok() const {
+        return ok_;
+    }
+};
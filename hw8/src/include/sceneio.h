@@ -1,11 +1,19 @@
 #pragma once
 #include <iostream>
+#include <optional>
+#include <string>
 #include "scene.h"
 
 namespace sceneio {
 
-Texture loadTexture(std::string_view file);
-void renderScene(Scene &scene, std::string_view outFileName);
-Scene loadScene(std::string_view gltfFilename);
+// Eagerly decodes an 8-bit RGB image into linear floats
+std::optional<Texture> loadTexture(std::string_view file, bool isSRGB);
+// Returns false if the output file cannot be created or written
+bool renderScene(Scene &scene, std::string_view outFileName);
+// With a cacheDir, the scene is read from or written to a scene cache there, see scene_cache.h
+Scene loadScene(std::string_view gltfFilename, const std::string &cacheDir = "");
+// Returns false, leaving the scene empty, if the file cannot be opened or parsed
+bool loadScene(std::string_view gltfFilename, Scene &scene, const std::string &cacheDir = "");
+bool setCameraFromNode(Scene &scene, size_t nodeIndex);
 
 }
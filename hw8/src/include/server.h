@@ -0,0 +1,25 @@
+#pragma once
+#include <string_view>
+
+namespace server {
+
+/**
+ * Long-lived render daemon listening on a Unix socket.
+ *
+ * Every connection sends one request line of whitespace-separated key=value pairs:
+ *   scene=<gltf> out=<ppm> width=<w> height=<h> samples=<spp>
+ *   [env=<image>] [node=<camera node>] [eye=x,y,z forward=x,y,z up=x,y,z fovy=<rad>]
+ *   [sampler=random|sobol|halton] [integrator=mix|nee]
+ * and receives a single "OK <seconds>" or "ERROR <message>" line back. A request
+ * line must arrive within 5 seconds and be at most 4096 bytes long.
+ * The line "shutdown" stops the daemon.
+ *
+ * Loaded scenes and environment maps stay resident between jobs, up to a
+ * few of each with the least recently used dropped first, and are reloaded
+ * only when the file modification time changes. A scene is cached once per
+ * glTF file; the environment map of each job is attached to it as the job
+ * starts.
+ */
+int serve(std::string_view socketPath);
+
+}
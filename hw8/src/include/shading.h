@@ -0,0 +1,44 @@
+#pragma once
+#include <cmath>
+#include "vec3.h"
+#include "color.h"
+
+// Orthonormal basis around a unit vector (Duff et al., "Building an Orthonormal Basis, Revisited")
+inline void buildBasis(const Vec3 &n, Vec3 &t, Vec3 &b) {
+    float sign = std::copysign(1.f, n.z);
+    float a = -1.f / (sign + n.z);
+    float c = n.x * n.y * a;
+    t = Vec3(1.f + sign * n.x * n.x * a, sign * c, -sign * n.x);
+    b = Vec3(c, sign + n.y * n.y * a, -n.y);
+}
+
+/**
+ * One path vertex as the direction strategies and the BRDF see it, built once per hit: the
+ * point rays leave from, an orthonormal frame (t, b, n) around the shading normal, the
+ * direction back to the viewer in world and local space, and the material parameters with
+ * textures already applied. Local space has the shading normal along z.
+ */
+struct ShadingPoint {
+    Vec3 x;
+    Vec3 t, b, n;
+    Vec3 v, localV;
+    Color albedo;
+    float metallic;
+    float alpha, alpha2;
+    // Share of BRDF samples given to the specular lobe (Vndf) rather than the diffuse one (Cosine)
+    float specularShare = 0.5f;
+
+    ShadingPoint(const Vec3 &x, const Vec3 &n, const Vec3 &v, const Color &albedo, float metallic, float alpha)
+        : x(x), n(n), v(v), albedo(albedo), metallic(metallic), alpha(alpha), alpha2(alpha * alpha) {
+        buildBasis(n, t, b);
+        localV = toLocal(v);
+    }
+
+    Vec3 toLocal(const Vec3 &d) const {
+        return {d.dot(t), d.dot(b), d.dot(n)};
+    }
+
+    Vec3 toWorld(const Vec3 &d) const {
+        return d.x * t + d.y * b + d.z * n;
+    }
+};
@@ -0,0 +1,237 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include "vec3.h"
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define HW8_SIMD_SSE 1
+#define HW8_SIMD_NEWTON_STEPS 1
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define HW8_SIMD_NEON 1
+#define HW8_SIMD_NEWTON_STEPS 2
+#else
+#define HW8_SIMD_NEWTON_STEPS 0
+#endif
+
+/**
+ * Four floats in one SIMD register (SSE2 on x86-64, NEON on ARM, plain floats elsewhere), for
+ * the ray, intersection and shading kernels. Vectors are loaded from Vec3 with w = 0 and the
+ * horizontal operations ending in 3 ignore w. Storage stays in Vec3: 12 bytes per vector keeps
+ * figures and BVH nodes compact, and the kernels only pay for a load.
+ *
+ * rcp and rsqrt start from the hardware estimate (12 bits on SSE, 8 on NEON) and take Newton
+ * steps up to nearly full float precision, at a fraction of the cost of a division or sqrt.
+ */
+class alignas(16) Float4 {
+public:
+#if HW8_SIMD_SSE
+    __m128 v;
+    Float4(__m128 v): v(v) {}
+#elif HW8_SIMD_NEON
+    float32x4_t v;
+    Float4(float32x4_t v): v(v) {}
+#else
+    float v[4];
+#endif
+
+    Float4() {}
+
+    explicit Float4(float s) {
+#if HW8_SIMD_SSE
+        v = _mm_set1_ps(s);
+#elif HW8_SIMD_NEON
+        v = vdupq_n_f32(s);
+#else
+        v[0] = v[1] = v[2] = v[3] = s;
+#endif
+    }
+
+    Float4(float x, float y, float z, float w) {
+#if HW8_SIMD_SSE
+        v = _mm_set_ps(w, z, y, x);
+#elif HW8_SIMD_NEON
+        const float lanes[4] = {x, y, z, w};
+        v = vld1q_f32(lanes);
+#else
+        v[0] = x;
+        v[1] = y;
+        v[2] = z;
+        v[3] = w;
+#endif
+    }
+
+    explicit Float4(const Vec3 &p): Float4(p.x, p.y, p.z, 0.f) {}
+
+    float operator[](int i) const {
+        alignas(16) float lanes[4];
+        store(lanes);
+        return lanes[i];
+    }
+
+    void store(float *out) const {
+#if HW8_SIMD_SSE
+        _mm_store_ps(out, v);
+#elif HW8_SIMD_NEON
+        vst1q_f32(out, v);
+#else
+        std::copy(v, v + 4, out);
+#endif
+    }
+
+    Vec3 vec3() const {
+        alignas(16) float lanes[4];
+        store(lanes);
+        return Vec3(lanes[0], lanes[1], lanes[2]);
+    }
+
+    float x() const {
+#if HW8_SIMD_SSE
+        return _mm_cvtss_f32(v);
+#elif HW8_SIMD_NEON
+        return vgetq_lane_f32(v, 0);
+#else
+        return v[0];
+#endif
+    }
+};
+
+#if HW8_SIMD_SSE
+
+inline Float4 operator + (Float4 a, Float4 b) { return _mm_add_ps(a.v, b.v); }
+inline Float4 operator - (Float4 a, Float4 b) { return _mm_sub_ps(a.v, b.v); }
+inline Float4 operator * (Float4 a, Float4 b) { return _mm_mul_ps(a.v, b.v); }
+inline Float4 operator / (Float4 a, Float4 b) { return _mm_div_ps(a.v, b.v); }
+inline Float4 operator - (Float4 a) { return _mm_xor_ps(a.v, _mm_set1_ps(-0.f)); }
+inline Float4 min(Float4 a, Float4 b) { return _mm_min_ps(a.v, b.v); }
+inline Float4 max(Float4 a, Float4 b) { return _mm_max_ps(a.v, b.v); }
+
+// Lanes of a where mask is set, of b elsewhere
+inline Float4 select(Float4 mask, Float4 a, Float4 b) {
+    return _mm_or_ps(_mm_and_ps(mask.v, a.v), _mm_andnot_ps(mask.v, b.v));
+}
+
+inline Float4 equal(Float4 a, Float4 b) { return _mm_cmpeq_ps(a.v, b.v); }
+inline Float4 rcpEstimate(Float4 a) { return _mm_rcp_ps(a.v); }
+inline Float4 rsqrtEstimate(Float4 a) { return _mm_rsqrt_ps(a.v); }
+
+// (y, z, x, w) and (z, x, y, w)
+inline Float4 rotate1(Float4 a) { return _mm_shuffle_ps(a.v, a.v, _MM_SHUFFLE(3, 0, 2, 1)); }
+inline Float4 rotate2(Float4 a) { return _mm_shuffle_ps(a.v, a.v, _MM_SHUFFLE(3, 1, 0, 2)); }
+
+#elif HW8_SIMD_NEON
+
+inline Float4 operator + (Float4 a, Float4 b) { return vaddq_f32(a.v, b.v); }
+inline Float4 operator - (Float4 a, Float4 b) { return vsubq_f32(a.v, b.v); }
+inline Float4 operator * (Float4 a, Float4 b) { return vmulq_f32(a.v, b.v); }
+inline Float4 operator - (Float4 a) { return vnegq_f32(a.v); }
+inline Float4 min(Float4 a, Float4 b) { return vminq_f32(a.v, b.v); }
+inline Float4 max(Float4 a, Float4 b) { return vmaxq_f32(a.v, b.v); }
+
+inline Float4 select(Float4 mask, Float4 a, Float4 b) {
+    return vbslq_f32(vreinterpretq_u32_f32(mask.v), a.v, b.v);
+}
+
+inline Float4 equal(Float4 a, Float4 b) { return vreinterpretq_f32_u32(vceqq_f32(a.v, b.v)); }
+inline Float4 rcpEstimate(Float4 a) { return vrecpeq_f32(a.v); }
+inline Float4 rsqrtEstimate(Float4 a) { return vrsqrteq_f32(a.v); }
+
+#if defined(__aarch64__)
+inline Float4 operator / (Float4 a, Float4 b) { return vdivq_f32(a.v, b.v); }
+#else
+inline Float4 operator / (Float4 a, Float4 b) {
+    Float4 r = vrecpeq_f32(b.v);
+    r = vmulq_f32(r.v, vrecpsq_f32(b.v, r.v));
+    r = vmulq_f32(r.v, vrecpsq_f32(b.v, r.v));
+    return vmulq_f32(a.v, r.v);
+}
+#endif
+
+inline Float4 rotate1(Float4 a) {
+    float32x4_t yzwx = vextq_f32(a.v, a.v, 1);
+    return vsetq_lane_f32(vgetq_lane_f32(a.v, 3), vsetq_lane_f32(vgetq_lane_f32(a.v, 0), yzwx, 2), 3);
+}
+
+inline Float4 rotate2(Float4 a) {
+    return rotate1(rotate1(a));
+}
+
+#else
+
+template <typename F>
+inline Float4 lanewise(Float4 a, Float4 b, F f) {
+    return Float4(f(a.v[0], b.v[0]), f(a.v[1], b.v[1]), f(a.v[2], b.v[2]), f(a.v[3], b.v[3]));
+}
+
+inline Float4 operator + (Float4 a, Float4 b) { return lanewise(a, b, [](float x, float y) { return x + y; }); }
+inline Float4 operator - (Float4 a, Float4 b) { return lanewise(a, b, [](float x, float y) { return x - y; }); }
+inline Float4 operator * (Float4 a, Float4 b) { return lanewise(a, b, [](float x, float y) { return x * y; }); }
+inline Float4 operator / (Float4 a, Float4 b) { return lanewise(a, b, [](float x, float y) { return x / y; }); }
+inline Float4 operator - (Float4 a) { return Float4(-a.v[0], -a.v[1], -a.v[2], -a.v[3]); }
+inline Float4 min(Float4 a, Float4 b) { return lanewise(a, b, [](float x, float y) { return x < y ? x : y; }); }
+inline Float4 max(Float4 a, Float4 b) { return lanewise(a, b, [](float x, float y) { return x > y ? x : y; }); }
+
+// Masks are 1 or 0 per lane here
+inline Float4 select(Float4 mask, Float4 a, Float4 b) {
+    return Float4(mask.v[0] != 0 ? a.v[0] : b.v[0], mask.v[1] != 0 ? a.v[1] : b.v[1],
+                  mask.v[2] != 0 ? a.v[2] : b.v[2], mask.v[3] != 0 ? a.v[3] : b.v[3]);
+}
+
+inline Float4 equal(Float4 a, Float4 b) { return lanewise(a, b, [](float x, float y) { return x == y ? 1.f : 0.f; }); }
+inline Float4 rcpEstimate(Float4 a) { return Float4(1.f) / a; }
+
+inline Float4 rsqrtEstimate(Float4 a) {
+    return Float4(1.f / std::sqrt(a.v[0]), 1.f / std::sqrt(a.v[1]), 1.f / std::sqrt(a.v[2]), 1.f / std::sqrt(a.v[3]));
+}
+
+inline Float4 rotate1(Float4 a) { return Float4(a.v[1], a.v[2], a.v[0], a.v[3]); }
+inline Float4 rotate2(Float4 a) { return Float4(a.v[2], a.v[0], a.v[1], a.v[3]); }
+
+#endif
+
+// 1 / a; lanes of a that are zero or infinite keep the estimate, which is already exact there
+inline Float4 rcp(Float4 a) {
+    Float4 estimate = rcpEstimate(a), r = estimate;
+    for (int i = 0; i < HW8_SIMD_NEWTON_STEPS; i++) {
+        r = r * (Float4(2.f) - a * r);
+    }
+    return select(equal(estimate + estimate, estimate), estimate, r);
+}
+
+// 1 / sqrt(a) for positive a
+inline Float4 rsqrt(Float4 a) {
+    Float4 r = rsqrtEstimate(a);
+    for (int i = 0; i < HW8_SIMD_NEWTON_STEPS; i++) {
+        r = Float4(0.5f) * r * (Float4(3.f) - a * r * r);
+    }
+    return r;
+}
+
+// Same orientation as Vec3::cross
+inline Float4 cross3(Float4 a, Float4 b) {
+    return rotate2(a) * rotate1(b) - rotate1(a) * rotate2(b);
+}
+
+// The dot product of the xyz lanes, in every lane
+inline Float4 dot3(Float4 a, Float4 b) {
+    Float4 p = a * b;
+    return p + rotate1(p) + rotate2(p);
+}
+
+inline Float4 hmax3(Float4 a) {
+    return max(a, max(rotate1(a), rotate2(a)));
+}
+
+inline Float4 hmin3(Float4 a) {
+    return min(a, min(rotate1(a), rotate2(a)));
+}
+
+inline Float4 normalize3(Float4 a) {
+    return a * rsqrt(dot3(a, a));
+}
+
+// Unit vector along p by a refined rsqrt, for shading code where a few ulp do not matter
+inline Vec3 fastNormalize(const Vec3 &p) {
+    return normalize3(Float4(p)).vec3();
+}
@@ -0,0 +1,101 @@
+#pragma once
+#include <cassert>
+#include <cstddef>
+#include <vector>
+#include "buffer.h"
+
+/**
+ * Array that either owns its elements or views them inside a Buffer, such as a mapped scene cache,
+ * so large read-only scene data can be shared with the page cache instead of copied.
+ * Only an owning array can be grown or written.
+ */
+template <typename T>
+class Storage {
+private:
+    std::vector<T> owned;
+    Buffer mapped;
+    const T *data_ = nullptr;
+    size_t size_ = 0;
+
+    void sync() {
+        data_ = owned.data();
+        size_ = owned.size();
+    }
+
+public:
+    Storage() {}
+
+    // Views count elements at the start of bytes, which must be suitably aligned
+    Storage(const Buffer &bytes, size_t count): mapped(bytes), data_(reinterpret_cast<const T*>(bytes.data())), size_(count) {}
+
+    Storage(const Storage &other): owned(other.owned), mapped(other.mapped) {
+        if (other.isView()) {
+            data_ = other.data_;
+            size_ = other.size_;
+        } else {
+            sync();
+        }
+    }
+
+    // Leaves other as an empty owning array; a moved Buffer still holds its data pointer, so it is reset
+    Storage(Storage &&other) noexcept: owned(std::move(other.owned)), mapped(std::move(other.mapped)), data_(other.data_), size_(other.size_) {
+        other.owned.clear();
+        other.mapped = Buffer();
+        other.sync();
+    }
+
+    Storage &operator=(Storage other) noexcept {
+        owned.swap(other.owned);
+        std::swap(mapped, other.mapped);
+        std::swap(data_, other.data_);
+        std::swap(size_, other.size_);
+        return *this;
+    }
+
+    bool isView() const {
+        return mapped.data() != nullptr;
+    }
+
+    size_t size() const {
+        return size_;
+    }
+
+    const T *data() const {
+        return data_;
+    }
+
+    const T &operator[](size_t i) const {
+        return data_[i];
+    }
+
+    const T *begin() const {
+        return data_;
+    }
+
+    const T *end() const {
+        return data_ + size_;
+    }
+
+    T *mutableData() {
+        assert(!isView());
+        return owned.data();
+    }
+
+    void reserve(size_t count) {
+        assert(!isView());
+        owned.reserve(count);
+        sync();
+    }
+
+    void resize(size_t count) {
+        assert(!isView());
+        owned.resize(count);
+        sync();
+    }
+
+    void push_back(const T &value) {
+        assert(!isView());
+        owned.push_back(value);
+        sync();
+    }
+};
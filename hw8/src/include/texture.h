@@ -0,0 +1,81 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <vector>
+#include "vec3.h"
+
+/**
+ * RGB image holding linear values, so filtering never has to convert color spaces.
+ * Texels are kept either as floats or as 8-bit codes that are decoded through a 256-entry
+ * table (the form TextureCache pages are filled from). Every texture carries a full box-filtered mip chain.
+ */
+class Texture {
+private:
+    struct Level {
+        int width, height;
+        std::vector<float> linear;
+        std::vector<uint8_t> codes;
+    };
+
+    std::vector<Level> levels;
+    const std::array<float, 256> *decode = nullptr;
+    bool isSRGB = false;
+
+    static size_t offset(const Level &level, int ix, int iy) {
+        return 3 * (ix + static_cast<size_t>(level.width) * iy);
+    }
+
+    void storeLevel(Level &level, const std::vector<float> &values, bool asFloat) const;
+
+    Vec3 load(const Level &l, size_t offset) const {
+        if (!l.linear.empty()) {
+            return Vec3{l.linear[offset], l.linear[offset + 1], l.linear[offset + 2]};
+        }
+        const auto &table = *decode;
+        return Vec3{table[l.codes[offset]], table[l.codes[offset + 1]], table[l.codes[offset + 2]]};
+    }
+
+public:
+    int width = 0, height = 0;
+
+    Texture() {}
+    Texture(int width, int height, const uint8_t *rgb, bool isSRGB, bool asFloat);
+
+    Vec3 texel(int ix, int iy, int level = 0) const {
+        const Level &l = levels[level];
+        return load(l, offset(l, ix, iy));
+    }
+
+    // Bilinear blend of the 2x2 texels from (ix, iy), wrapping around the level edges
+    Vec3 bilinear(int level, int ix, int iy, float dx, float dy) const {
+        const Level &l = levels[level];
+        int ix2 = ix + 1 == l.width ? 0 : ix + 1;
+        int iy2 = iy + 1 == l.height ? 0 : iy + 1;
+        size_t o11 = offset(l, ix, iy);
+        size_t o21 = offset(l, ix2, iy);
+        size_t o12 = offset(l, ix, iy2);
+        size_t o22 = offset(l, ix2, iy2);
+        return (1 - dx) * ((1 - dy) * load(l, o11) + dy * load(l, o12)) + dx * ((1 - dy) * load(l, o21) + dy * load(l, o22));
+    }
+
+    // Raw codes of a texel in a texture kept as 8-bit codes
+    const uint8_t *codesAt(int ix, int iy, int level) const {
+        const Level &l = levels[level];
+        return l.codes.data() + offset(l, ix, iy);
+    }
+
+    static const std::array<float, 256> &decodeTable(bool isSRGB);
+
+    int levelCount() const {
+        return levels.size();
+    }
+
+    int levelWidth(int level) const {
+        return levels[level].width;
+    }
+
+    int levelHeight(int level) const {
+        return levels[level].height;
+    }
+};
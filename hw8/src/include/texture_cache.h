@@ -0,0 +1,293 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <vector>
+#include "vec3.h"
+#include "texture.h"
+#include "buffer.h"
+
+class CachedTexture;
+
+/**
+ * Scene textures decoded on first use and kept as 8-bit codes in a fixed pool of 32x32 texel pages.
+ *
+ * Only image headers are read up front. The first lookup that misses a page decodes the whole
+ * image (with its mip chain) and installs the page, evicting by the CLOCK approximation of LRU
+ * when the pool is full. The other pages of the image are installed too while there are free
+ * slots or slots not referenced since the last sweep, so one decode usually serves the whole
+ * image but never pushes out pages other images are using.
+ *
+ * Hits take no locks: a page table maps every page to a slot, and each slot carries a sequence
+ * number that is odd while the slot is rewritten (a seqlock). A reader copies the texels, then
+ * checks that the slot still belongs to its page and was not touched meanwhile, and retries otherwise.
+ * Misses serialize on the image being decoded and on page installation.
+ */
+class TextureCache {
+public:
+    static constexpr int PAGE_LOG = 5;
+    static constexpr int PAGE = 1 << PAGE_LOG;
+    static constexpr size_t PAGE_BYTES = 3 * PAGE * PAGE;
+    static constexpr size_t DEFAULT_BUDGET = 1ull << 30;
+
+private:
+    static constexpr uint32_t NO_SLOT = UINT32_MAX;
+    static constexpr uint64_t NO_OWNER = UINT64_MAX;
+
+    struct Level {
+        int width, height;
+        int pagesX;
+        uint32_t firstPage;
+    };
+
+    struct Image {
+        // Either a file or encoded bytes; neither for an image whose header could not be read, it decodes as white
+        std::string path;
+        Buffer encoded;
+        // Every page already decoded, as read from a scene cache; such an image bypasses the pool
+        Buffer pages;
+        bool isSRGB;
+        const std::array<float, 256> *decode;
+        int width, height;
+        std::vector<Level> levels;
+        uint32_t pageCount;
+        std::unique_ptr<std::atomic<uint32_t>[]> pageTable;
+        std::unique_ptr<std::mutex> loading;
+    };
+
+    struct Slot {
+        std::atomic<uint32_t> sequence{0};
+        std::atomic<uint64_t> owner{NO_OWNER};
+        std::atomic<bool> referenced{false};
+    };
+
+    size_t budget = DEFAULT_BUDGET;
+    std::vector<Image> images;
+
+    // Pool state is created on the first miss and changed only under mutex
+    std::unique_ptr<std::mutex> mutex = std::make_unique<std::mutex>();
+    mutable std::unique_ptr<Slot[]> slots;
+    mutable std::unique_ptr<uint8_t[]> pool;
+    mutable uint32_t slotCount = 0;
+    mutable uint32_t clockHand = 0;
+    mutable uint32_t usedSlots = 0;
+    mutable size_t decodes = 0;
+
+    // Texels inside a page are stored row by row
+    static size_t pageOffset(int lx, int ly) {
+        return 3 * ((static_cast<size_t>(ly) << PAGE_LOG) + lx);
+    }
+
+    static uint64_t ownerKey(size_t image, uint32_t page) {
+        return (static_cast<uint64_t>(image) << 32) | page;
+    }
+
+    static Vec3 decodeTexel(const std::array<float, 256> &table, const uint8_t *codes) {
+        return Vec3{table[codes[0]], table[codes[1]], table[codes[2]]};
+    }
+
+    static bool initImage(Image &image, bool ok, bool isSRGB);
+    static void initLevels(Image &image);
+    static Texture decodeImage(const Image &img);
+    static void copyPage(const Image &img, uint32_t page, const Texture &decoded, uint8_t *data);
+    std::vector<uint8_t> decodePages(size_t image) const;
+    static int levelOf(const Image &img, uint32_t page);
+    void load(size_t image, uint32_t page) const;
+    uint32_t evict() const;
+    std::optional<uint32_t> evictUnreferenced() const;
+    void install(size_t image, uint32_t page, const Texture &decoded, uint32_t slot, bool referenced) const;
+
+    /**
+     * Calls read with the bytes of a resident page until it completes without the page being
+     * replaced underneath; read must only copy data out.
+     */
+    template <typename F>
+    void readPage(size_t image, uint32_t page, F read) const {
+        const Image &img = images[image];
+        if (img.pages.size() > 0) {
+            read(reinterpret_cast<const uint8_t*>(img.pages.data()) + page * PAGE_BYTES);
+            return;
+        }
+        uint64_t key = ownerKey(image, page);
+        while (true) {
+            uint32_t slot = img.pageTable[page].load(std::memory_order_acquire);
+            if (slot == NO_SLOT) {
+                load(image, page);
+                continue;
+            }
+            Slot &s = slots[slot];
+            uint32_t sequence = s.sequence.load(std::memory_order_acquire);
+            if ((sequence & 1) || s.owner.load(std::memory_order_relaxed) != key) {
+                continue;
+            }
+            read(pool.get() + slot * PAGE_BYTES);
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (s.sequence.load(std::memory_order_relaxed) == sequence) {
+                if (!s.referenced.load(std::memory_order_relaxed)) {
+                    s.referenced.store(true, std::memory_order_relaxed);
+                }
+                return;
+            }
+        }
+    }
+
+public:
+    TextureCache() {}
+
+    // Takes effect when the pool is created, that is on the first lookup
+    void setBudget(size_t bytes) {
+        budget = bytes;
+    }
+
+    size_t getBudget() const {
+        return budget;
+    }
+
+    /**
+     * Reads or writes the images with all their pages decoded, see scene_cache.h.
+     * Writing decodes every image that is not resident yet, one at a time.
+     */
+    template <typename Archive>
+    void serialize(Archive &archive) {
+        size_t count = images.size();
+        archive.value(count);
+        images.resize(count);
+        for (size_t i = 0; i < count; i++) {
+            Image &image = images[i];
+            archive.value(image.isSRGB);
+            archive.value(image.width);
+            archive.value(image.height);
+            if constexpr (Archive::WRITING) {
+                archive.array(decodePages(i));
+            } else {
+                archive.array(image.pages);
+                image.decode = &Texture::decodeTable(image.isSRGB);
+                initLevels(image);
+                if (image.pages.size() != image.pageCount * PAGE_BYTES) {
+                    archive.fail();
+                }
+            }
+        }
+    }
+
+    void resize(size_t count);
+
+    /**
+     * Registers an image by its header; returns false (and registers a white image) if it cannot be read.
+     * Distinct images may be assigned concurrently.
+     */
+    bool assign(size_t image, const std::string &path, bool isSRGB);
+    // Same for an image held in memory, such as a bufferView of a .glb
+    bool assign(size_t image, const Buffer &encoded, bool isSRGB);
+
+    size_t size() const {
+        return images.size();
+    }
+
+    CachedTexture texture(size_t image) const;
+
+    int width(size_t image) const {
+        return images[image].width;
+    }
+
+    int height(size_t image) const {
+        return images[image].height;
+    }
+
+    int levelCount(size_t image) const {
+        return images[image].levels.size();
+    }
+
+    int levelWidth(size_t image, int level) const {
+        return images[image].levels[level].width;
+    }
+
+    int levelHeight(size_t image, int level) const {
+        return images[image].levels[level].height;
+    }
+
+    Vec3 texel(size_t image, int ix, int iy, int level = 0) const {
+        const Image &img = images[image];
+        const Level &l = img.levels[level];
+        uint32_t page = l.firstPage + (iy >> PAGE_LOG) * l.pagesX + (ix >> PAGE_LOG);
+        size_t offset = pageOffset(ix & (PAGE - 1), iy & (PAGE - 1));
+        uint8_t codes[3];
+        readPage(image, page, [&](const uint8_t *data) {
+            std::copy_n(data + offset, 3, codes);
+        });
+        return decodeTexel(*img.decode, codes);
+    }
+
+    // Bilinear blend of the 2x2 texels from (ix, iy), wrapping around the level edges
+    Vec3 bilinear(size_t image, int level, int ix, int iy, float dx, float dy) const {
+        const Image &img = images[image];
+        const Level &l = img.levels[level];
+        int ix2 = ix + 1 == l.width ? 0 : ix + 1;
+        int iy2 = iy + 1 == l.height ? 0 : iy + 1;
+        Vec3 p11, p21, p12, p22;
+        if (ix2 == ix + 1 && iy2 == iy + 1 && (ix & (PAGE - 1)) != PAGE - 1 && (iy & (PAGE - 1)) != PAGE - 1) {
+            // The whole footprint is inside one page
+            uint32_t page = l.firstPage + (iy >> PAGE_LOG) * l.pagesX + (ix >> PAGE_LOG);
+            size_t offset = pageOffset(ix & (PAGE - 1), iy & (PAGE - 1));
+            uint8_t codes[12];
+            readPage(image, page, [&](const uint8_t *data) {
+                std::copy_n(data + offset, 6, codes);
+                std::copy_n(data + offset + 3 * PAGE, 6, codes + 6);
+            });
+            p11 = decodeTexel(*img.decode, codes);
+            p21 = decodeTexel(*img.decode, codes + 3);
+            p12 = decodeTexel(*img.decode, codes + 6);
+            p22 = decodeTexel(*img.decode, codes + 9);
+        } else {
+            p11 = texel(image, ix, iy, level);
+            p21 = texel(image, ix2, iy, level);
+            p12 = texel(image, ix, iy2, level);
+            p22 = texel(image, ix2, iy2, level);
+        }
+        return (1 - dx) * ((1 - dy) * p11 + dy * p12) + dx * ((1 - dy) * p21 + dy * p22);
+    }
+
+    size_t residentBytes() const;
+    size_t decodeCount() const;
+};
+
+// One image of a TextureCache with the lookup interface of Texture
+class CachedTexture {
+private:
+    const TextureCache *cache;
+    size_t image;
+
+public:
+    int width, height;
+
+    CachedTexture(const TextureCache &cache, size_t image)
+        : cache(&cache), image(image), width(cache.width(image)), height(cache.height(image)) {}
+
+    Vec3 texel(int ix, int iy, int level = 0) const {
+        return cache->texel(image, ix, iy, level);
+    }
+
+    Vec3 bilinear(int level, int ix, int iy, float dx, float dy) const {
+        return cache->bilinear(image, level, ix, iy, dx, dy);
+    }
+
+    int levelCount() const {
+        return cache->levelCount(image);
+    }
+
+    int levelWidth(int level) const {
+        return cache->levelWidth(image, level);
+    }
+
+    int levelHeight(int level) const {
+        return cache->levelHeight(image, level);
+    }
+};
+
+inline CachedTexture TextureCache::texture(size_t image) const {
+    return CachedTexture(*this, image);
+}
@@ -14,6 +14,7 @@ public:
     Vec3 operator / (const Vec3 &other) const;
     Vec3 operator * (const Vec3 &other) const;
     Vec3 operator + (float v) const;
+    Vec3 operator - () const;
     float dot(const Vec3 &other) const;
     Vec3 cross(const Vec3 &other) const;
 
@@ -50,6 +51,10 @@ inline Vec3 Vec3::operator + (float v) const {
     return {x + v, y + v, z + v};
 }
 
+inline Vec3 Vec3::operator - () const {
+    return {-x, -y, -z};
+}
+
 inline float Vec3::dot(const Vec3 &other) const {
     return x * other.x + y * other.y + z * other.z;
 }
@@ -63,7 +68,7 @@ inline float Vec3::len2() const {
 }
 
 inline float Vec3::len() const {
-    return sqrt(len2());
+    return std::sqrt(len2());
 }
 
 inline std::istream& operator >> (std::istream &in, Vec3 &point) {
@@ -76,5 +81,5 @@ inline Vec3 operator * (float k, const Vec3 &p) {
 }
 
 inline Vec3 Vec3::normalize() const {
-    return 1. / len() * (*this);
+    return (1.f / len()) * (*this);
 }
\ No newline at end of file
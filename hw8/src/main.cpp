@@ -1,18 +1,69 @@
 #include <fstream>
+#include <cstring>
 #include "scene.h"
 #include "sceneio.h"
+#include "server.h"
 
 using namespace std;
 
 int main(int argc, const char *argv[]) {
-    Scene scene = sceneio::loadScene(argv[1]);
-    scene.width = strtol(argv[2], nullptr, 10);
-    scene.height = strtol(argv[3], nullptr, 10);
-    scene.samples = strtol(argv[4], nullptr, 10);
-    if (argc > 6) {
-        scene.environmentMap = sceneio::loadTexture(argv[6]); // TODO: or true?
+    if (argc == 3 && std::string_view(argv[1]) == "--server") {
+        return server::serve(argv[2]);
     }
-    sceneio::renderScene(scene, argv[5]);
+
+    std::vector<const char*> args;
+    SamplerType samplerType = SamplerType::Sobol;
+    Integrator integrator = Integrator::Mix;
+    size_t textureBudget = TextureCache::DEFAULT_BUDGET;
+    std::string sceneCache;
+    for (int i = 0; i < argc; i++) {
+        std::string_view arg = argv[i];
+        if (arg.rfind("--sampler=", 0) == 0) {
+            auto type = samplerTypeFromString(arg.substr(strlen("--sampler=")));
+            if (!type.has_value()) {
+                std::cerr << "Unknown sampler: " << arg << std::endl;
+                return 1;
+            }
+            samplerType = type.value();
+        } else if (arg.rfind("--integrator=", 0) == 0) {
+            auto type = integratorFromString(arg.substr(strlen("--integrator=")));
+            if (!type.has_value()) {
+                std::cerr << "Unknown integrator: " << arg << std::endl;
+                return 1;
+            }
+            integrator = type.value();
+        } else if (arg.rfind("--texture-budget=", 0) == 0) {
+            textureBudget = strtoull(argv[i] + strlen("--texture-budget="), nullptr, 10) << 20;
+        } else if (arg.rfind("--scene-cache=", 0) == 0) {
+            sceneCache = arg.substr(strlen("--scene-cache="));
+        } else {
+            args.push_back(argv[i]);
+        }
+    }
+
+    Scene scene;
+    scene.textureCache.setBudget(textureBudget);
+    if (!sceneio::loadScene(args[1], scene, sceneCache)) {
+        return 1;
+    }
+    scene.width = strtol(args[2], nullptr, 10);
+    scene.height = strtol(args[3], nullptr, 10);
+    scene.samples = strtol(args[4], nullptr, 10);
+    scene.samplerType = samplerType;
+    scene.integrator = integrator;
+    if (args.size() > 6) {
+        auto environmentMap = sceneio::loadTexture(args[6], true);
+        if (!environmentMap.has_value()) {
+            std::cerr << "Cannot load environment map: " << args[6] << std::endl;
+            return 1;
+        }
+        scene.setEnvironmentMap(environmentMap.value());
+    }
+    if (!sceneio::renderScene(scene, args[5])) {
+        return 1;
+    }
+    std::cerr << "Texture cache: " << scene.textureCache.decodeCount() << " decodes, "
+              << (scene.textureCache.residentBytes() >> 20) << " MiB resident" << std::endl;
     std::cerr << "FINISH" << std::endl;
     return 0;
-}
\ No newline at end of file
+}
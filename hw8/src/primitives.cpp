@@ -9,119 +9,66 @@ Figure::Figure(Vertex data): data(data) {};
 
 Figure::Figure(Vertex data, Vertex data2, Vertex data3): data(data), data2(data2), data3(data3) {};
 
-static const float T_MAX = 1e4;
+static const float T_MAX = 1e4f;
 
 std::optional<Intersection> Figure::intersect(const Ray &ray) const {
-    return intersectAsTriangle(ray);
-}
-
-std::optional<Intersection> intersectPlaneAndRay(const Vec3 &n, const Ray &ray) {
-    float t = -ray.o.dot(n) / ray.d.dot(n);
-    if (t > 0 && t < T_MAX) {
-        if (ray.d.dot(n) > 0) {
-            return {Intersection {t, -1. * n, {}, {}, {}, true}};
-        }
-        return {Intersection {t, n, {}, {}, {}, false}};
-    }
-    return {};
-}
-
-std::optional<Intersection> intersectBoxAndRay(const Vec3 &s, const Ray &ray, bool require_norma = true) {
-    Vec3 ts1 = (-1. * s - ray.o) / ray.d;
-    Vec3 ts2 = (s - ray.o) / ray.d;
-    float t1x = std::min(ts1.x, ts2.x), t2x = std::max(ts1.x, ts2.x);
-    float t1y = std::min(ts1.y, ts2.y), t2y = std::max(ts1.y, ts2.y);
-    float t1z = std::min(ts1.z, ts2.z), t2z = std::max(ts1.z, ts2.z);
-    float t1 = std::max(std::max(t1x, t1y), t1z);
-    float t2 = std::min(std::min(t2x, t2y), t2z);
-    if (t1 > t2 || t2 < 0) {
+    auto triangleHit = hit(PreparedRay(ray));
+    if (!triangleHit.has_value()) {
         return {};
     }
-    
-    float t;
-    bool is_inside;
-    if (t1 < 0) {
-        is_inside = true;
-        t = t2;
-    } else {
-        is_inside = false;
-        t = t1;
-    }
-
-    if (!require_norma) {
-        return {Intersection {t, {}, {}, {}, {}, is_inside}};
-    }
-
-    Vec3 p = ray.o + t * ray.d;
-    Vec3 geomNorma = p / s;
-    float mx = std::max(std::max(fabs(geomNorma.x), fabs(geomNorma.y)), fabs(geomNorma.z));
-
-    if (fabs(geomNorma.x) != mx) {
-        geomNorma.x = 0;
-    }
-    if (fabs(geomNorma.y) != mx) {
-        geomNorma.y = 0;
-    }
-    if (fabs(geomNorma.z) != mx) {
-        geomNorma.z = 0;
-    }
-
-    if (is_inside) {
-        geomNorma = -1. * geomNorma;
-    }
-
-    return {Intersection {t, geomNorma, {}, {}, {}, is_inside}};
-}  
-
-std::pair<float, float> solveLinearSystem(float a1, float b1, float c1, float a2, float b2, float c2) {
-    float y = (c1 * a2 - c2 * a1) / (b1 * a2 - a1 * b2);
-    float x = a2 == 0 ? (c1 - b1 * y) / a1 : (c2 - b2 * y) / a2;
-    return {x, y};
+    return interpolate(triangleHit.value());
 }
 
-static const float magic1[] = {0.239, 0.419, 0.533};
-static const float magic2[] = {0.35743, 0.66682, 0.69695};
+static const Float4 magic1(0.239f, 0.419f, 0.533f, 0.f);
+static const Float4 magic2(0.35743f, 0.66682f, 0.69695f, 0.f);
+
+std::optional<TriangleHit> Figure::hit(const PreparedRay &ray) const {
+    Float4 a(data3.coords);
+    Float4 b = Float4(data.coords) - a;
+    Float4 c = Float4(data2.coords) - a;
+    Float4 n = cross3(b, c);
+    Float4 o = ray.o - a;
 
-std::optional<Intersection> Figure::intersectAsTriangle(const Ray &ray) const {
-    const Vec3 &a = data3.coords;
-    const Vec3 &b = data.coords - a;
-    const Vec3 &c = data2.coords - a;
-    Vec3 n = b.cross(c);
-    auto intersection = intersectPlaneAndRay(n, ray - a);
-    if (!intersection.has_value()) {
+    // The plane through the triangle
+    float dotDN = dot3(ray.d, n).x();
+    float t = -dot3(o, n).x() / dotDN;
+    if (!(t > 0 && t < T_MAX)) {
         return {};
     }
-    auto [t, geomNorma, _, _2, _3, is_inside] = intersection.value();
-    Vec3 p = ray.o - a + t * ray.d;
-
-    auto a1 = magic1[0] * b.x + magic1[1] * b.y + magic1[2] * b.z;
-    auto b1 = magic1[0] * c.x + magic1[1] * c.y + magic1[2] * c.z;
-    auto c1 = magic1[0] * p.x + magic1[1] * p.y + magic1[2] * p.z;
-
-    auto a2 = magic2[0] * b.x + magic2[1] * b.y + magic2[2] * b.z;
-    auto b2 = magic2[0] * c.x + magic2[1] * c.y + magic2[2] * c.z;
-    auto c2 = magic2[0] * p.x + magic2[1] * p.y + magic2[2] * p.z;
-    auto [u, v] = solveLinearSystem(a1, b1, c1, a2, b2, c2);
+    Float4 p = o + Float4(t) * ray.d;
 
+    // p = u * b + v * c, projected on two fixed directions
+    float a1 = dot3(magic1, b).x(), b1 = dot3(magic1, c).x(), c1 = dot3(magic1, p).x();
+    float a2 = dot3(magic2, b).x(), b2 = dot3(magic2, c).x(), c2 = dot3(magic2, p).x();
+    float v = (c1 * a2 - c2 * a1) / (b1 * a2 - a1 * b2);
+    float u = a2 == 0 ? (c1 - b1 * v) / a1 : (c2 - b2 * v) / a2;
     if (u < 0 || v < 0 || u + v > 1) {
         return {};
     }
+    return {TriangleHit {t, u, v, dotDN > 0}};
+}
 
-    Vec3 shadingNorma = data3.normals + u * (data.normals - data3.normals) + v * (data2.normals - data3.normals);
+Intersection Figure::interpolate(const TriangleHit &hit) const {
+    auto [t, u, v, isInside] = hit;
+    Vec3 geomNorma = (data.coords - data3.coords).cross(data2.coords - data3.coords);
+
+    Vec3 n1 = data.normal(), n2 = data2.normal(), n3 = data3.normal();
+    Vec3 shadingNorma = n3 + u * (n1 - n3) + v * (n2 - n3);
     Vec2 texcoords = Vec2(
         data3.texcoords.x + u * (data.texcoords.x - data3.texcoords.x) + v * (data2.texcoords.x - data3.texcoords.x),
         data3.texcoords.y + u * (data.texcoords.y - data3.texcoords.y) + v * (data2.texcoords.y - data3.texcoords.y)
     );
-    Vec4 tangent = Vec4(data3.tangents.v + u * (data.tangents.v - data3.tangents.v) + v * (data2.tangents.v - data3.tangents.v), data.tangents.w);
-    tangent.v = tangent.v.normalize();
-    shadingNorma = shadingNorma.normalize();
-    if (is_inside) {
-        shadingNorma = -1. * shadingNorma;
+    Vec3 t1 = data.tangent().v, t2 = data2.tangent().v, t3 = data3.tangent().v;
+    Vec4 tangent = Vec4(fastNormalize(t3 + u * (t1 - t3) + v * (t2 - t3)), data.tangentSign);
+    shadingNorma = fastNormalize(shadingNorma);
+    geomNorma = fastNormalize(geomNorma);
+    if (isInside) {
+        shadingNorma = -shadingNorma;
+        geomNorma = -geomNorma;
         // tangent.v = -1. * tangent.v;
         // tangent.w = -1. * tangent.w;
     }
-    geomNorma = geomNorma.normalize();
-    return {{t, geomNorma, texcoords, shadingNorma, tangent, is_inside}};
+    return {t, geomNorma, texcoords, shadingNorma, tangent, isInside};
 }
 
 AABB::AABB() {}
@@ -159,7 +106,3 @@ float AABB::getS() const {
     Vec3 d = max - min;
     return 2 * (d.x * d.y + d.x * d.z + d.y * d.z);
 }
-
-std::optional<Intersection> AABB::intersect(const Ray &ray) const {
-    return intersectBoxAndRay(0.5 * (max - min), ray - 0.5 * (min + max), false);
-}
\ No newline at end of file
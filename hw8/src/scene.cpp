@@ -1,37 +1,48 @@
 #include "scene.h"
-#include "stb_image.h"
 #include <cmath>
-#include <random>
 #include <algorithm>
 
 static const size_t DIRTY_DENOISE_HACK_BUBEN = 6;
 
-static Vec3 loadSingleFromTexture(int ix, int iy, const Texture &texture, bool isSRGB) {
-    size_t offset = 3 * (ix + texture.width * iy);
-    Vec3 res = (1. / 255) * Vec3{1.f * texture.data[offset], 1.f * texture.data[offset + 1], 1.f * texture.data[offset + 2]};
-    if (isSRGB) {
-        return Vec3{std::pow(res.x, 2.2f), std::pow(res.y, 2.2f), std::pow(res.z, 2.2f)};
-    }
-    return res;
-}
-
-static Vec3 sampleTexture(float texcoordX, float texcoordY, const Texture &texture, bool isSRGB) {
+template <typename T>
+static Vec3 sampleLevel(float texcoordX, float texcoordY, const T &texture, int level) {
+    int width = texture.levelWidth(level), height = texture.levelHeight(level);
     texcoordX -= std::floor(texcoordX);
     texcoordY -= std::floor(texcoordY);
 
-    texcoordX *= texture.width;
-    texcoordY *= texture.height;
+    texcoordX *= width;
+    texcoordY *= height;
+
+    int ix = std::min<int>(texcoordX, width - 1);
+    int iy = std::min<int>(texcoordY, height - 1);
+    return texture.bilinear(level, ix, iy, texcoordX - ix, texcoordY - iy);
+}
 
-    int ix1 = std::floor(texcoordX), ix2 = (ix1 + 1) % texture.width;
-    int iy1 = std::floor(texcoordY), iy2 = (iy1 + 1) % texture.height;
+/**
+ * Trilinear lookup. lod is log2 of the footprint width in texture coordinates,
+ * so the mip level is that plus log2 of the texture size.
+ */
+template <typename T>
+static Vec3 sampleTexture(float texcoordX, float texcoordY, const T &texture, float lod = -INFINITY) {
+    float level = lod + 0.5f * std::log2(static_cast<float>(texture.width) * texture.height);
+    if (!(level > 0)) {
+        return sampleLevel(texcoordX, texcoordY, texture, 0);
+    }
+    level = std::min<float>(level, texture.levelCount() - 1);
+    int level1 = level;
+    float f = level - level1;
+    if (f == 0) {
+        return sampleLevel(texcoordX, texcoordY, texture, level1);
+    }
+    return (1 - f) * sampleLevel(texcoordX, texcoordY, texture, level1) + f * sampleLevel(texcoordX, texcoordY, texture, level1 + 1);
+}
 
-    float dx = texcoordX - ix1;
-    float dy = texcoordY - iy1;
-    Vec3 px1y1 = loadSingleFromTexture(ix1, iy1, texture, isSRGB);
-    Vec3 px1y2 = loadSingleFromTexture(ix1, iy2, texture, isSRGB);
-    Vec3 px2y1 = loadSingleFromTexture(ix2, iy1, texture, isSRGB);
-    Vec3 px2y2 = loadSingleFromTexture(ix2, iy2, texture, isSRGB);
-    return (1 - dx) * ((1 - dy) * px1y1 + dy * px1y2) + dx * ((1 - dy) * px2y1 + dy * px2y2);
+// log2 of texture coordinate length per unit of world length on the triangle
+static float triangleLod(const Figure &figure) {
+    float worldArea = (figure.data2.coords - figure.data.coords).cross(figure.data3.coords - figure.data.coords).len();
+    Vec2 t1 = figure.data.texcoords, t2 = figure.data2.texcoords, t3 = figure.data3.texcoords;
+    float uvArea = std::fabs((t2.x - t1.x) * (t3.y - t1.y) - (t3.x - t1.x) * (t2.y - t1.y));
+    return 0.5f * std::log2(uvArea / worldArea);
 }
 
 static Vec3 applyNormalMaps(Vec3 shadingNorma, Vec4 tangent, Vec3 sample, bool isInside) {
@@ -41,139 +52,280 @@ static Vec3 applyNormalMaps(Vec3 shadingNorma, Vec4 tangent, Vec3 sample, bool i
     Vec3 localX = tangent.v;
     Vec3 localZ = shadingNorma;
     Vec3 localY = tangent.w * localX.cross(localZ);
-    Vec3 localNorma = 2.f * sample - Vec3{1., 1., 1.};
+    Vec3 localNorma = 2.f * sample - Vec3{1.f, 1.f, 1.f};
     Vec3 norma = localNorma.x * localX + localNorma.y * localY + localNorma.z * localZ;
     // if (isInside) {
     //     norma = -1. * norma;
     //     shadingNorma = -1. * shadingNorma;
     // }
-    norma = norma.normalize();
-    return norma;
+    return fastNormalize(norma);
 }
 
 Scene::Scene() {}
 
-Scene::~Scene() {
+// The last mip level holds the average of the whole image
+static float averageLuminance(const CachedTexture &texture) {
+    return luminance(texture.texel(0, 0, texture.levelCount() - 1));
+}
+
+void Scene::initDistribution() {
+    std::vector<float> materialPower;
+    for (const auto &material : materials) {
+        float power = luminance(material.emission);
+        if (power > 0 && material.emissiveTexture.has_value()) {
+            power *= averageLuminance(textureCache.texture(textureDescs[material.emissiveTexture.value()].source));
+        }
+        materialPower.push_back(power);
+    }
+
+    setDistribution(FiguresMix(figures, materialPower));
+}
+
+void Scene::setDistribution(FiguresMix lightDistribution) {
+    std::optional<EnvironmentLight> environmentDistribution;
     if (environmentMap.has_value()) {
-        stbi_image_free(environmentMap.value().data);
+        environmentDistribution = EnvironmentLight(environmentMap.value());
+        if (environmentDistribution.value().isEmpty()) {
+            environmentDistribution.reset();
+        }
     }
-    for (const auto &texture : textureImages) {
-        stbi_image_free(texture.data);
+    bool hasFigures = !lightDistribution.isEmpty();
+    if (hasFigures && environmentDistribution.has_value()) {
+        distribution = Mix<Cosine, Vndf, FiguresMix, EnvironmentLight>(
+            Cosine(), Vndf(), std::move(lightDistribution), std::move(environmentDistribution.value()));
+    } else if (hasFigures) {
+        distribution = Mix<Cosine, Vndf, FiguresMix>(Cosine(), Vndf(), std::move(lightDistribution));
+    } else if (environmentDistribution.has_value()) {
+        distribution = Mix<Cosine, Vndf, EnvironmentLight>(Cosine(), Vndf(), std::move(environmentDistribution.value()));
+    } else {
+        distribution = Mix<Cosine, Vndf>(Cosine(), Vndf());
     }
 }
 
-void Scene::initDistribution() {
-    auto lightDistribution = FiguresMix(figures);
-    std::vector<std::variant<Cosine, Vndf, FiguresMix>> finalDistributions;
-    finalDistributions.push_back(Cosine());
-    finalDistributions.push_back(Vndf());
-    if (!lightDistribution.isEmpty()) {
-        finalDistributions.push_back(lightDistribution);
+EnvironmentMap Scene::toEnvironmentMap(const Texture &texture) {
+    // Same texel count as the equirectangular source, each texel averages 2x2 lookups into it
+    int size = std::max(1, static_cast<int>(std::ceil(std::sqrt(static_cast<double>(texture.width) * texture.height))));
+    std::vector<Color> texels(static_cast<size_t>(size) * size);
+    for (int iy = 0; iy < size; iy++) {
+        for (int ix = 0; ix < size; ix++) {
+            Color sum{0, 0, 0};
+            for (int sy = 0; sy < 2; sy++) {
+                for (int sx = 0; sx < 2; sx++) {
+                    Vec3 d = octahedralDecode((ix + 0.25f + 0.5f * sx) / size, (iy + 0.25f + 0.5f * sy) / size);
+                    float texcoordX = 0.5 + 0.5 * std::atan2(d.z, d.x) / M_PI;
+                    float texcoordY = 0.5 - std::asin(std::clamp(d.y, -1.f, 1.f)) / M_PI;
+                    sum = sum + sampleTexture(texcoordX, texcoordY, texture);
+                }
+            }
+            texels[ix + static_cast<size_t>(size) * iy] = 0.25f * sum;
+        }
     }
-    distribution = Mix(finalDistributions);
+    return EnvironmentMap(size, std::move(texels));
 }
 
-void Scene::initBVH() {
-    bvh = BVH(figures, figures.size());
+void Scene::setEnvironmentMap(const Texture &texture) {
+    setEnvironmentMap(toEnvironmentMap(texture));
 }
 
-std::optional<std::pair<Intersection, int>> Scene::intersect(const Ray &ray) const {
-    return bvh.intersect(figures, ray, {});
+void Scene::setEnvironmentMap(std::optional<EnvironmentMap> map) {
+    environmentMap = std::move(map);
+    // The emitter strategy does not depend on the environment, so its light tree is moved over rather than rebuilt
+    FiguresMix lights = std::visit([](auto &mix) {
+        FiguresMix *current = mix.figuresMix();
+        return current != nullptr ? std::move(*current) : FiguresMix();
+    }, distribution);
+    setDistribution(std::move(lights));
 }
 
-Color Scene::getColor(std::uniform_real_distribution<float> &u01, std::normal_distribution<float> &n01, rng_type &rng, const Ray &ray, int recLimit) {
-    if (recLimit == 0) {
-        return {0., 0., 0.};
-    }
-
-    auto intersection_ = intersect(ray);
-    if (!intersection_.has_value()) {
-        if (!environmentMap.has_value()) {
-            return bgColor;
+// Applied in place cycle by cycle, so a second copy of the figures is never held
+void Scene::reorderFigures(const std::vector<uint32_t> &order) {
+    Figure *data = figures.mutableData();
+    std::vector<bool> placed(order.size(), false);
+    for (uint32_t start = 0; start < order.size(); start++) {
+        if (placed[start]) {
+            continue;
         }
-        float texcoordX = 0.5 + 0.5 * std::atan2(ray.d.z, ray.d.x) / M_PI;
-        float texcoordY = 0.5 - std::asin(ray.d.y) / M_PI;
-        return sampleTexture(texcoordX, texcoordY, environmentMap.value(), true);
+        Figure first = std::move(data[start]);
+        uint32_t i = start;
+        while (order[i] != start) {
+            data[i] = std::move(data[order[i]]);
+            placed[i] = true;
+            i = order[i];
+        }
+        data[i] = std::move(first);
+        placed[i] = true;
     }
+    std::visit([&order](auto &mix) {
+        mix.reorderFigures(order);
+    }, distribution);
+}
 
-    auto [intersection, figurePos] = intersection_.value();
-    auto [t, geomNorma, texcoords, shadingNorma_, tangent, isInside] = intersection;
-    auto shadingNorma = shadingNorma_.value();
-    auto figurePtr = figures.begin() + figurePos;
-    const auto &material = figurePtr->material;
-    auto x = ray.o + t * ray.d;
-
-    const auto &materialModel = materialModels[figurePtr->materialIndex];
-    Vec3 color{1, 1, 1};
-    if (material.baseColorTexture.has_value()) {
-        color = sampleTexture(
-            texcoords.value().x,
-            texcoords.value().y,
-            textureImages[textureDescs[material.baseColorTexture.value()].source],
-            true
-        );
-    }
+std::optional<std::pair<Intersection, int>> Scene::intersect(const Ray &ray) const {
+    return bvh.intersect(figures, ray, {});
+}
 
+Vec3 Scene::getEmission(const Intersection &intersection, int figurePos, float lod) const {
+    const auto &material = figures[figurePos].material;
     Vec3 emission = material.emission;
     if (material.emissiveTexture.has_value()) {
         emission = emission * sampleTexture(
-            texcoords.value().x,
-            texcoords.value().y,
-            textureImages[textureDescs[material.emissiveTexture.value()].source],
-            true
+            intersection.texcoords.value().x,
+            intersection.texcoords.value().y,
+            textureCache.texture(textureDescs[material.emissiveTexture.value()].source),
+            lod
         );
     }
+    return emission;
+}
 
-    Vec3 metallicRoughness = {1, 1, 1};
-    if (material.metallicRoughnessTexture.has_value()) {
-        metallicRoughness = sampleTexture(
-            texcoords.value().x,
-            texcoords.value().y,
-            textureImages[textureDescs[material.metallicRoughnessTexture.value()].source],
-            false
-        );
+Color Scene::getEnvironment(Vec3 d) const {
+    if (!environmentMap.has_value()) {
+        return bgColor;
     }
+    return environmentMap.value().lookup(d);
+}
 
-    Vec3 sample{0.5, 0.5, 1};
-    if (material.normalTexture.has_value()) {
-        sample = sampleTexture(
-            texcoords.value().x,
-            texcoords.value().y,
-            textureImages[textureDescs[material.normalTexture.value()].source],
-            false
-        );
-    }
-    shadingNorma = applyNormalMaps(shadingNorma, tangent.value(), sample, isInside);
+static float powerHeuristic(float pdf, float otherPdf) {
+    return pdf * pdf / (pdf * pdf + otherPdf * otherPdf);
+}
 
-    float alpha = pow(std::max(0.08f, material.roughnessFactor * metallicRoughness.y), 2.0);
-    float metallic = metallicRoughness.z;
+template <typename Distribution>
+Color Scene::getColor(Sampler &sampler, Ray ray, const Distribution &distribution) const {
+    bool nee = integrator == Integrator::Nee && distribution.hasLights();
+    Color result{0, 0, 0};
+    Vec3 throughput{1, 1, 1};
+    // MIS weight of emission found by the BRDF continuation against the shadow rays
+    float emissionWeight = 1;
+    // Ray cone for texture filtering (Akenine-Moller et al., "Improved Shader and Texture Level of Detail
+    // Using Ray Cones"): footprint width at the current vertex and spread angle, starting from one pixel
+    float coneWidth = 0;
+    float coneSpread = std::atan(2 * std::tan(cameraFovY / 2) / height);
+    auto intersection_ = intersect(ray);
+    for (int bounce = 0; bounce < rayDepth; bounce++) {
+        if (!intersection_.has_value()) {
+            return result + emissionWeight * throughput * getEnvironment(ray.d);
+        }
 
-    Vec3 d = distribution.sample(u01, n01, rng, x + eps * geomNorma, shadingNorma, ray.d, alpha);
-    Ray dRay = Ray(x + eps * geomNorma, d);
-    Vec3 brdf = materialModel.brdf(dRay.d, -1. * ray.d, shadingNorma, color, metallic, alpha);
-    if ((brdf.x < eps && brdf.y < eps && brdf.z < eps)) {
-        return emission;
-    }
+        auto [intersection, figurePos] = intersection_.value();
+        auto [t, geomNorma, texcoords, shadingNorma_, tangent, isInside] = intersection;
+        auto shadingNorma = shadingNorma_.value();
+        const Figure *figurePtr = &figures[figurePos];
+        const auto &material = figurePtr->material;
+        auto x = ray.o + t * ray.d;
+        coneWidth += coneSpread * t;
+        float lod = triangleLod(*figurePtr) + std::log2(coneWidth / std::fabs(geomNorma.dot(ray.d)));
 
-    float pdf = distribution.pdf(x + eps * geomNorma, shadingNorma, d, ray.d, alpha);
-    auto mult = 1. / pdf * fabs(d.dot(shadingNorma)) * brdf;
+        const auto &materialModel = materialModels[figurePtr->materialIndex];
+        Vec3 color{1, 1, 1};
+        if (material.baseColorTexture.has_value()) {
+            color = sampleTexture(
+                texcoords.value().x,
+                texcoords.value().y,
+                textureCache.texture(textureDescs[material.baseColorTexture.value()].source),
+                lod
+            );
+        }
 
-    if (mult.x > DIRTY_DENOISE_HACK_BUBEN || mult.y > DIRTY_DENOISE_HACK_BUBEN || mult.z > DIRTY_DENOISE_HACK_BUBEN || std::isnan(mult.x) || std::isnan(mult.y) || std::isnan(mult.z)) {
-        return emission;
+        result = result + emissionWeight * throughput * getEmission(intersection, figurePos, lod);
+        if (bounce + 1 == rayDepth) {
+            break;
+        }
+
+        Vec3 metallicRoughness = {1, 1, 1};
+        if (material.metallicRoughnessTexture.has_value()) {
+            metallicRoughness = sampleTexture(
+                texcoords.value().x,
+                texcoords.value().y,
+                textureCache.texture(textureDescs[material.metallicRoughnessTexture.value()].source),
+                lod
+            );
+        }
+
+        if (material.normalTexture.has_value()) {
+            Vec3 sample = sampleTexture(
+                texcoords.value().x,
+                texcoords.value().y,
+                textureCache.texture(textureDescs[material.normalTexture.value()].source),
+                lod
+            );
+            shadingNorma = applyNormalMaps(shadingNorma, tangent.value(), sample, isInside);
+        }
+
+        float roughness = std::max(0.08f, material.roughnessFactor * metallicRoughness.y);
+        float alpha = roughness * roughness;
+
+        sampler.startBounce(bounce);
+        // Frame, view direction and material of this vertex, shared by every strategy and BRDF call below
+        ShadingPoint point(x + eps * geomNorma, shadingNorma, -ray.d,
+                           materialModel.albedo(color), materialModel.metallic(metallicRoughness.z), alpha);
+        point.specularShare = materialModel.specularShare(point);
+        if (nee) {
+            auto [lightD, lightTarget] = distribution.sampleLight(sampler, point);
+            Vec3 lightBrdf = materialModel.brdf(point, lightD);
+            if (lightBrdf.x >= eps || lightBrdf.y >= eps || lightBrdf.z >= eps) {
+                // Unoccluded only if the first hit is the sampled emitter itself
+                auto shadow = intersect(Ray(point.x, lightD));
+                if (reachesTarget(lightTarget, shadow)) {
+                    float lightPdf = distribution.pdfLight(point, lightD, shadow);
+                    float bsdfPdf = distribution.pdfBsdf(point, lightD);
+                    if (lightPdf > 0) {
+                        float weight = powerHeuristic(lightPdf, bsdfPdf) / lightPdf * std::fabs(lightD.dot(point.n));
+                        Color emission = shadow.has_value() ? getEmission(shadow.value().first, shadow.value().second) : getEnvironment(lightD);
+                        result = result + weight * throughput * lightBrdf * emission;
+                    }
+                }
+            }
+        }
+
+        auto [d, target] = nee
+            ? distribution.sampleBsdf(sampler, point)
+            : distribution.sample(sampler, point);
+        Ray dRay = Ray(point.x, d);
+        Vec3 brdf = materialModel.brdf(point, dRay.d);
+        if ((brdf.x < eps && brdf.y < eps && brdf.z < eps)) {
+            break;
+        }
+
+        // The continuation ray is traced once: its hit is both the next vertex and
+        // the emitter that the light sampling density is evaluated for
+        auto next = intersect(dRay);
+        if (!reachesTarget(target, next)) {
+            break;
+        }
+        float pdf;
+        if (nee) {
+            pdf = distribution.pdfBsdf(point, d);
+            emissionWeight = powerHeuristic(pdf, distribution.pdfLight(point, d, next));
+        } else {
+            pdf = distribution.pdf(point, d, next);
+        }
+        Vec3 mult = (std::fabs(d.dot(point.n)) / pdf) * brdf;
+
+        if (mult.x > DIRTY_DENOISE_HACK_BUBEN || mult.y > DIRTY_DENOISE_HACK_BUBEN || mult.z > DIRTY_DENOISE_HACK_BUBEN || std::isnan(mult.x) || std::isnan(mult.y) || std::isnan(mult.z)) {
+            break;
+        }
+        throughput = throughput * mult;
+        // Rough scattering widens the cone by about the lobe width
+        coneSpread += 2 * alpha;
+        ray = dRay;
+        intersection_ = next;
     }
-    return emission + mult * getColor(u01, n01, rng, dRay, recLimit - 1);
+    return result;
 }
 
-Color Scene::getPixel(rng_type &rng, int x, int y) {
-    std::uniform_real_distribution<float> u01(0.0, 1.0);
-    std::normal_distribution<float> n01(0.0, 1.0);
+Color Scene::getPixel(int x, int y) {
+    Sampler sampler(samplerType, y * width + x);
     Color color {0, 0, 0};
-    for (int _ = 0; _ < samples; _++) {
-        float nx = x + u01(rng);
-        float ny = y + u01(rng);
-        color = color + getColor(u01, n01, rng, getCameraRay(nx, ny), rayDepth);
-    }
-    return 1.0 / samples * color;
+    // Resolved once per pixel, so each path runs against one concrete mixture
+    std::visit([&](const auto &mix) {
+        for (int i = 0; i < samples; i++) {
+            sampler.startSample(firstSample + i);
+            float nx = x + sampler.get1D();
+            float ny = y + sampler.get1D();
+            color = color + getColor(sampler, getCameraRay(nx, ny), mix);
+        }
+    }, distribution);
+    return (1.f / samples) * color;
 }
 
 Ray Scene::getCameraRay(float x, float y) const {
@@ -0,0 +1,138 @@
+#include "scene_cache.h"
+#include "scene.h"
+#include <filesystem>
+#include <iostream>
+#include <unistd.h>
+
+namespace scene_cache {
+
+static const char MAGIC[8] = {'H', 'W', '8', 'S', 'C', 'E', 'N', 'E'};
+
+struct Header {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t key;
+    uint64_t size;
+};
+
+// Four independent multiply-xor lanes over 8-byte words, so hashing runs near memory speed
+uint64_t hashBytes(const char *data, size_t size, uint64_t seed) {
+    static const uint64_t K = 0x9E3779B97F4A7C15ull;
+    uint64_t lanes[4] = {seed ^ size, seed + K, seed ^ (K >> 1), seed - K};
+    size_t i = 0;
+    for (; i + 32 <= size; i += 32) {
+        for (int lane = 0; lane < 4; lane++) {
+            uint64_t word;
+            std::memcpy(&word, data + i + 8 * lane, 8);
+            lanes[lane] = (lanes[lane] ^ word) * K;
+            lanes[lane] ^= lanes[lane] >> 29;
+        }
+    }
+    uint64_t h = lanes[0] ^ (lanes[1] * 3) ^ (lanes[2] * 5) ^ (lanes[3] * 7);
+    for (; i < size; i++) {
+        h = (h ^ static_cast<uint8_t>(data[i])) * K;
+    }
+    h ^= h >> 32;
+    return h * K;
+}
+
+bool load(const std::string &path, uint64_t key, Scene &scene) {
+    auto file = Buffer::map(path);
+    if (!file.has_value()) {
+        return false;
+    }
+    Header header;
+    if (file.value().size() < sizeof(header)) {
+        return false;
+    }
+    std::memcpy(&header, file.value().data(), sizeof(header));
+    if (std::memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0 || header.version != VERSION
+            || header.key != key || header.size != file.value().size()) {
+        return false;
+    }
+
+    // Read into a scratch scene first, so a damaged file leaves the target as it was
+    Scene cached;
+    cached.textureCache.setBudget(scene.textureCache.getBudget());
+    CacheReader reader(file.value(), sizeof(header));
+    cached.serialize(reader);
+    if (!reader.ok()) {
+        std::cerr << "Damaged scene cache " << path << std::endl;
+        return false;
+    }
+    scene = std::move(cached);
+    return true;
+}
+
+bool save(const std::string &path, uint64_t key, Scene &scene) {
+    // Written aside and renamed into place, so concurrent renders never see a partial file
+    std::string temporary = path + ".tmp" + std::to_string(getpid());
+    {
+        std::ofstream out(temporary, std::ios::binary);
+        Header header{};
+        std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+        header.version = VERSION;
+        header.key = key;
+        out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        CacheWriter writer(out, sizeof(header));
+        scene.serialize(writer);
+        header.size = writer.size();
+        out.seekp(0);
+        out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        if (!writer.ok() || !out.good()) {
+            out.close();
+            std::filesystem::remove(temporary);
+            std::cerr << "Cannot write scene cache " << path << std::endl;
+            return false;
+        }
+    }
+    std::error_code error;
+    std::filesystem::rename(temporary, path, error);
+    if (error) {
+        std::filesystem::remove(temporary, error);
+        std::cerr << "Cannot write scene cache " << path << std::endl;
+        return false;
+    }
+    return true;
+}
+
+}
+
+template <typename Archive>
+void Scene::serialize(Archive &archive) {
+    archive.array(figures);
+    bvh.serialize(archive);
+    if constexpr (Archive::WRITING) {
+        FiguresMix *lights = std::visit([](auto &mix) {
+            return mix.figuresMix();
+        }, distribution);
+        FiguresMix empty;
+        (lights != nullptr ? *lights : empty).serialize(archive);
+    } else {
+        FiguresMix lights;
+        lights.serialize(archive);
+        setDistribution(std::move(lights));
+    }
+
+    archive.array(materials);
+    archive.array(materialModels);
+    archive.array(textureDescs);
+    textureCache.serialize(archive);
+
+    // Only what cameras need survives of the node hierarchy
+    size_t nodeCount = nodes.size();
+    archive.value(nodeCount);
+    nodes.resize(nodeCount);
+    for (auto &node : nodes) {
+        archive.value(node.camera);
+        archive.value(node.totalTransition);
+    }
+    archive.array(cameraYFovs);
+    archive.value(cameraNode);
+    archive.value(cameraPos);
+    archive.value(cameraUp);
+    archive.value(cameraRight);
+    archive.value(cameraForward);
+    archive.value(cameraFovY);
+}
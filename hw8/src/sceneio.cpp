@@ -1,27 +1,95 @@
 #define STB_IMAGE_IMPLEMENTATION
 
 #include "rapidjson/document.h"
-#include "rapidjson/istreamwrapper.h"
 #include "stb_image.h"
 #include "sceneio.h"
+#include "accessor_view.h"
+#include "scene_cache.h"
 #include <fstream>
 #include <sstream>
 #include <iostream>
+#include <iomanip>
 #include <filesystem>
+#include <chrono>
+#include <cstring>
+#include <cstdio>
+#include <array>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
 
 namespace sceneio {
 
-void loadBuffers(std::string_view gltfFilename, const rapidjson::Document &gltfScene, Scene &scene) {
+static const int RESIDENT_ROWS_PER_THREAD = 4;
+
+static const uint32_t GLB_MAGIC = 0x46546C67;
+static const uint32_t GLB_CHUNK_JSON = 0x4E4F534A;
+static const uint32_t GLB_CHUNK_BIN = 0x004E4942;
+
+struct GltfSource {
+    Buffer json;
+    // The BIN chunk of a .glb, it backs the buffer that has no uri
+    std::optional<Buffer> bin;
+};
+
+static uint32_t readUint32(const char *p) {
+    uint32_t result;
+    std::memcpy(&result, p, sizeof(result));
+    return result;
+}
+
+/**
+ * Splits a mapped scene file into its JSON and binary parts, without copying either.
+ * A .glb is a 12-byte header (magic, version, length) followed by 8-byte-headed chunks, JSON first;
+ * anything else is taken as plain .gltf JSON.
+ */
+static std::optional<GltfSource> splitGltf(const Buffer &file) {
+    if (file.size() < 12 || readUint32(file.data()) != GLB_MAGIC) {
+        return GltfSource{file, {}};
+    }
+    size_t length = std::min<size_t>(readUint32(file.data() + 8), file.size());
+    std::optional<Buffer> json, bin;
+    for (size_t offset = 12; offset + 8 <= length;) {
+        size_t chunkLength = readUint32(file.data() + offset);
+        uint32_t chunkType = readUint32(file.data() + offset + 4);
+        if (chunkLength > length - offset - 8) {
+            std::cerr << "Truncated .glb chunk at " << offset << std::endl;
+            break;
+        }
+        if (chunkType == GLB_CHUNK_JSON && !json.has_value()) {
+            json = file.slice(offset + 8, chunkLength);
+        } else if (chunkType == GLB_CHUNK_BIN && !bin.has_value()) {
+            bin = file.slice(offset + 8, chunkLength);
+        }
+        offset += 8 + chunkLength;
+    }
+    if (!json.has_value()) {
+        std::cerr << "No JSON chunk in .glb" << std::endl;
+        return {};
+    }
+    return GltfSource{json.value(), bin};
+}
+
+void loadBuffers(std::string_view gltfFilename, const rapidjson::Document &gltfScene, const std::optional<Buffer> &bin, Scene &scene) {
     const auto &bufferSpecs = gltfScene["buffers"].GetArray();
-    for (const auto &bufSpec : bufferSpecs) {
-        size_t sz = bufSpec["byteLength"].GetUint();
-        Buffer buf(sz);
-        
+    scene.buffers.resize(bufferSpecs.Size());
+    #pragma omp taskloop grainsize(1) default(shared)
+    for (size_t i = 0; i < bufferSpecs.Size(); i++) {
+        size_t byteLength = bufferSpecs[i]["byteLength"].GetUint64();
+        if (!bufferSpecs[i].HasMember("uri")) {
+            if (bin.has_value() && bin.value().size() >= byteLength) {
+                scene.buffers[i] = bin.value().slice(0, byteLength);
+            } else {
+                #pragma omp critical
+                std::cerr << "Buffer " << i << " has no uri and no BIN chunk to take" << std::endl;
+                scene.buffers[i] = Buffer::zeros(byteLength);
+            }
+            continue;
+        }
         const auto gltfFilePath = std::filesystem::path(gltfFilename);
-        const auto bufferFilePath = gltfFilePath.parent_path().append(bufSpec["uri"].GetString());
-        std::ifstream bufferStream(bufferFilePath, std::ios::binary);
-        bufferStream.read(buf.data(), sz);
-        scene.buffers.push_back(buf);
+        const auto bufferFilePath = gltfFilePath.parent_path().append(bufferSpecs[i]["uri"].GetString());
+        scene.buffers[i] = Buffer(bufferFilePath.string(), byteLength);
     }
 }
 
@@ -30,8 +98,9 @@ void loadBufferViews(const rapidjson::Document &gltfScene, Scene &scene) {
     for (const auto &bufferViewSpec : bufferViewSpecs) {
         scene.bufferViews.push_back(BufferView{
             bufferViewSpec["buffer"].GetUint(),
-            bufferViewSpec["byteLength"].GetUint(),
-            bufferViewSpec["byteOffset"].GetUint(),
+            bufferViewSpec["byteLength"].GetUint64(),
+            bufferViewSpec.HasMember("byteOffset") ? bufferViewSpec["byteOffset"].GetUint64() : 0ull,
+            bufferViewSpec.HasMember("byteStride") ? bufferViewSpec["byteStride"].GetUint64() : 0ull
         });
     }
 }
@@ -105,10 +174,11 @@ void loadAccessors(const rapidjson::Document &gltfScene, Scene &scene) {
             .count = accessor["count"].GetUint(),
             .componentType = accessor["componentType"].GetUint(),
             .type = accessor["type"].GetString(),
-            .byteOffset = 0
+            .byteOffset = 0,
+            .normalized = accessor.HasMember("normalized") && accessor["normalized"].GetBool()
         };
         if (accessor.HasMember("byteOffset")) {
-            curAccessor.byteOffset = accessor["byteOffset"].GetFloat();
+            curAccessor.byteOffset = accessor["byteOffset"].GetUint64();
         }
         scene.accessors.push_back(curAccessor);
     }
@@ -133,61 +203,31 @@ void calculateTransitions(Scene &scene) {
     }
 }
 
-std::vector<Vec2> loadVec2s(size_t index, Scene &scene) {
-    std::vector<Vec2> positions;
+/**
+ * View of an accessor holding elements of type T (its glTF type name is expected).
+ * An accessor reaching past its buffer, or of a component type T cannot hold, reads as zeros.
+ */
+template <typename T>
+AccessorView<T> accessorView(size_t index, const char *expectedType, const Scene &scene) {
     const auto &accessor = scene.accessors[index];
     const auto &bufferView = scene.bufferViews[accessor.bufferView];
     const auto &buffer = scene.buffers[bufferView.buffer];
-    if (accessor.type != "VEC2") {
-        std::cerr << "Load VEC2 accessor: " << accessor.type << std::endl;
+    static const char zeros[16] = {};
+    if (accessor.type != expectedType) {
+        std::cerr << "Load " << expectedType << " accessor: " << accessor.type << std::endl;
     }
-    size_t byteOffset = bufferView.byteOffset + accessor.byteOffset;
-    for (size_t i = 0; i < accessor.count; i++) {
-        Vec2 position;
-        position.x = *(reinterpret_cast<const float*>(buffer.data() + byteOffset + 8 * i));
-        position.y = *(reinterpret_cast<const float*>(buffer.data() + byteOffset + 8 * i + 4));
-        positions.push_back(position);
-    }
-    return positions;
-}
-
-std::vector<Vec3> loadVec3s(size_t index, Scene &scene) {
-    std::vector<Vec3> positions;
-    const auto &accessor = scene.accessors[index];
-    const auto &bufferView = scene.bufferViews[accessor.bufferView];
-    const auto &buffer = scene.buffers[bufferView.buffer];
-    if (accessor.type != "VEC3") {
-        std::cerr << "Load VEC3 accessor: " << accessor.type << std::endl;
+    if (!AccessorView<T>::supports(accessor.componentType)) {
+        std::cerr << "Unexpected accessor component type: " << accessor.componentType << std::endl;
+        return AccessorView<T>(zeros, accessor.count, 0, 5126, false);
     }
+    size_t elementSize = AccessorView<T>::elementSize(accessor.componentType);
+    size_t stride = bufferView.byteStride != 0 ? bufferView.byteStride : elementSize;
     size_t byteOffset = bufferView.byteOffset + accessor.byteOffset;
-    for (size_t i = 0; i < accessor.count; i++) {
-        Vec3 position;
-        position.x = *(reinterpret_cast<const float*>(buffer.data() + byteOffset + 12 * i));
-        position.y = *(reinterpret_cast<const float*>(buffer.data() + byteOffset + 12 * i + 4));
-        position.z = *(reinterpret_cast<const float*>(buffer.data() + byteOffset + 12 * i + 8));
-        positions.push_back(position);
-    }
-    return positions;
-}
-
-std::vector<Vec4> loadVec4s(size_t index, Scene &scene) {
-    std::vector<Vec4> positions;
-    const auto &accessor = scene.accessors[index];
-    const auto &bufferView = scene.bufferViews[accessor.bufferView];
-    const auto &buffer = scene.buffers[bufferView.buffer];
-    if (accessor.type != "VEC4") {
-        std::cerr << "Load VEC4 accessor: " << accessor.type << std::endl;
+    if (accessor.count > 0 && byteOffset + (accessor.count - 1) * stride + elementSize > buffer.size()) {
+        std::cerr << "Accessor " << index << " is out of its buffer" << std::endl;
+        return AccessorView<T>(zeros, accessor.count, 0, accessor.componentType, accessor.normalized);
     }
-    size_t byteOffset = bufferView.byteOffset + accessor.byteOffset;
-    for (size_t i = 0; i < accessor.count; i++) {
-        Vec4 position;
-        position.v.x = *(reinterpret_cast<const float*>(buffer.data() + byteOffset + 16 * i));
-        position.v.y = *(reinterpret_cast<const float*>(buffer.data() + byteOffset + 16 * i + 4));
-        position.v.z = *(reinterpret_cast<const float*>(buffer.data() + byteOffset + 16 * i + 8));
-        position.w = *(reinterpret_cast<const float*>(buffer.data() + byteOffset + 16 * i + 12));
-        positions.push_back(position);
-    }
-    return positions;
+    return AccessorView<T>(buffer.data() + byteOffset, accessor.count, stride, accessor.componentType, accessor.normalized);
 }
 
 void loadMaterials(const rapidjson::Document &gltfScene, Scene &scene) {
@@ -244,98 +284,177 @@ void loadMaterials(const rapidjson::Document &gltfScene, Scene &scene) {
     }
 }
 
-void loadFigures(size_t indicesIndex, const Transition &transition, size_t material, const std::vector<Vec3> &positions, const std::vector<Vec2> &texcoords, const std::vector<Vec3> &normals, const std::vector<Vec4> &tangents, Scene &scene) {
-    std::vector<Figure> figures;
-    const auto &accessor = scene.accessors[indicesIndex];
-    const auto &bufferView = scene.bufferViews[accessor.bufferView];
-    const auto &buffer = scene.buffers[bufferView.buffer];
-    if (accessor.type != "SCALAR") {
-        std::cerr << "Load figures accessor: " << accessor.type << std::endl;
-    }
-    auto materialValue = scene.materials[material];
+// Writes one figure per index triple, starting at out
+void loadFigures(const Primitive &primitive, const Transition &transition, const Scene &scene, Figure *out) {
+    auto indices = accessorView<uint32_t>(primitive.indices, "SCALAR", scene);
+    auto positions = accessorView<Vec3>(primitive.positions, "VEC3", scene);
+    auto texcoords = accessorView<Vec2>(primitive.texcoords, "VEC2", scene);
+    auto normals = accessorView<Vec3>(primitive.normals, "VEC3", scene);
+    auto tangents = accessorView<Vec4>(primitive.tangent, "VEC4", scene);
+
+    auto materialValue = scene.materials[primitive.material];
     auto normalTransition = transition.inverted().transposed();
-    for (size_t i = 0; i < accessor.count; i += 3) {
-        size_t pos1, pos2, pos3;
-        if (accessor.componentType == 5123) {
-            pos1 = *(reinterpret_cast<const uint16_t*>(buffer.data() + bufferView.byteOffset + 2 * i));
-            pos2 = *(reinterpret_cast<const uint16_t*>(buffer.data() + bufferView.byteOffset + 2 * (i + 1)));
-            pos3 = *(reinterpret_cast<const uint16_t*>(buffer.data() + bufferView.byteOffset + 2 * (i + 2)));
-        } else {
-            if (accessor.componentType != 5125) {
-                std::cerr << "Unexpected accessor component type: " << accessor.componentType << std::endl;
-            }
-            pos1 = *(reinterpret_cast<const uint32_t*>(buffer.data() + bufferView.byteOffset + 4 * i));
-            pos2 = *(reinterpret_cast<const uint32_t*>(buffer.data() + bufferView.byteOffset + 4 * (i + 1)));
-            pos3 = *(reinterpret_cast<const uint32_t*>(buffer.data() + bufferView.byteOffset + 4 * (i + 2)));
+    Vec3 shift = transition.apply({0, 0, 0});
+    size_t vertexCount = std::min({positions.size(), texcoords.size(), normals.size(), tangents.size()});
+    size_t badIndices = 0;
+    for (size_t i = 0; i + 2 < indices.size(); i += 3) {
+        size_t pos[3] = {indices[i], indices[i + 1], indices[i + 2]};
+        badIndices += (pos[0] >= vertexCount) + (pos[1] >= vertexCount) + (pos[2] >= vertexCount);
+        Vertex vertices[3];
+        for (int k = 0; k < 3; k++) {
+            Vec4 tangent = tangents[pos[k]];
+            vertices[k] = Vertex{
+                transition.apply(positions[pos[k]]),
+                texcoords[pos[k]],
+                normalTransition.apply(normals[pos[k]]).normalize(),
+                Vec4((transition.apply(tangent.v) - shift).normalize(), tangent.w)
+            };
         }
-        Vec3 p1 = transition.apply(positions[pos1]);
-        Vec3 p2 = transition.apply(positions[pos2]);
-        Vec3 p3 = transition.apply(positions[pos3]);
-
-        Vec2 tc1 = texcoords[pos1];
-        Vec2 tc2 = texcoords[pos2];
-        Vec2 tc3 = texcoords[pos3];
-
-        Vec3 n1 = normalTransition.apply(normals[pos1]).normalize();
-        Vec3 n2 = normalTransition.apply(normals[pos2]).normalize();
-        Vec3 n3 = normalTransition.apply(normals[pos3]).normalize();
-
-        Vec3 shift = transition.apply({0, 0, 0});
 
-        Vec4 tan1 = Vec4((transition.apply(tangents[pos1].v) - shift).normalize(), tangents[pos1].w);
-        Vec4 tan2 = Vec4((transition.apply(tangents[pos2].v) - shift).normalize(), tangents[pos2].w);
-        Vec4 tan3 = Vec4((transition.apply(tangents[pos3].v) - shift).normalize(), tangents[pos3].w);
-
-        Figure fig({p1, tc1, n1, tan1}, {p3, tc3, n3, tan3}, {p2, tc2, n2, tan2});
+        Figure fig(vertices[0], vertices[2], vertices[1]);
         fig.material = materialValue;
-        fig.materialIndex = material;
-        scene.figures.push_back(fig);
+        fig.materialIndex = primitive.material;
+        *out++ = fig;
+    }
+    if (badIndices > 0) {
+        std::cerr << "Accessor " << primitive.indices << ": " << badIndices << " indices past the " << vertexCount << " vertices read as zeros" << std::endl;
     }
 }
 
+static std::array<size_t, 5> primitiveAccessors(const Primitive &primitive) {
+    return {primitive.indices, primitive.positions, primitive.texcoords, primitive.normals, primitive.tangent};
+}
+
+/**
+ * Primitives are converted in parallel, each into its own range of figures in node order.
+ * Once the last primitive reading a buffer view is converted, the view's pages are dropped,
+ * so mapped geometry does not stay resident next to the figures made from it.
+ */
 void loadFiguresFromNodes(Scene &scene) {
+    struct PrimitiveRange {
+        const Node *node;
+        const Primitive *primitive;
+        size_t first;
+    };
+    std::vector<PrimitiveRange> ranges;
+    size_t figureCount = 0;
     for (const auto &node : scene.nodes) {
         if (!node.mesh.has_value()) {
             continue;
         }
-        const auto &mesh = node.mesh.value();
-        for (const auto &primitive : scene.meshes[mesh].primitives) {
-            auto positions = loadVec3s(primitive.positions, scene);
-            auto texcoords = loadVec2s(primitive.texcoords, scene);
-            auto normals = loadVec3s(primitive.normals, scene);
-            auto tangents = loadVec4s(primitive.tangent, scene);
-            loadFigures(primitive.indices, node.totalTransition, primitive.material, positions, texcoords, normals, tangents, scene);
+        for (const auto &primitive : scene.meshes[node.mesh.value()].primitives) {
+            ranges.push_back({&node, &primitive, figureCount});
+            figureCount += scene.accessors[primitive.indices].count / 3;
+        }
+    }
+    scene.figures.resize(figureCount);
+
+    std::vector<std::atomic<uint32_t>> readers(scene.bufferViews.size());
+    for (const auto &range : ranges) {
+        for (size_t accessor : primitiveAccessors(*range.primitive)) {
+            readers[scene.accessors[accessor].bufferView].fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    #pragma omp taskloop grainsize(1) default(shared)
+    for (size_t i = 0; i < ranges.size(); i++) {
+        loadFigures(*ranges[i].primitive, ranges[i].node->totalTransition, scene, scene.figures.mutableData() + ranges[i].first);
+        for (size_t accessor : primitiveAccessors(*ranges[i].primitive)) {
+            size_t index = scene.accessors[accessor].bufferView;
+            if (readers[index].fetch_sub(1, std::memory_order_acq_rel) == 1) {
+                const auto &bufferView = scene.bufferViews[index];
+                const auto &buffer = scene.buffers[bufferView.buffer];
+                if (bufferView.byteOffset + bufferView.byteLength <= buffer.size()) {
+                    buffer.slice(bufferView.byteOffset, bufferView.byteLength).dropPages();
+                }
+            }
         }
     }
 }
 
-void loadCameraPosition(const rapidjson::Document &gltfScene, Scene &scene) {
+void loadCameras(const rapidjson::Document &gltfScene, Scene &scene) {
+    if (!gltfScene.HasMember("cameras")) {
+        return;
+    }
+    for (const auto &camera : gltfScene["cameras"].GetArray()) {
+        scene.cameraYFovs.push_back(camera["perspective"]["yfov"].GetFloat());
+    }
+}
+
+bool setCameraFromNode(Scene &scene, size_t nodeIndex) {
+    if (nodeIndex >= scene.nodes.size() || !scene.nodes[nodeIndex].camera.has_value()) {
+        return false;
+    }
+    const auto &node = scene.nodes[nodeIndex];
+    scene.cameraFovY = scene.cameraYFovs[node.camera.value()];
+    scene.cameraPos = node.totalTransition.apply({0, 0, 0});
+    scene.cameraUp = node.totalTransition.apply({0, 1, 0}) - scene.cameraPos;
+    scene.cameraRight = node.totalTransition.apply({1, 0, 0}) - scene.cameraPos;
+    scene.cameraForward = node.totalTransition.apply({0, 0, -1}) - scene.cameraPos;
+    return true;
+}
+
+void loadCameraPosition(Scene &scene) {
     scene.cameraUp = {0, 1, 0};
     scene.cameraForward = {0, 0, -1};
     scene.cameraRight = {1, 0, 0};
 
-    for (const auto &node : scene.nodes) {
-        if (node.camera.has_value()) {
-            scene.cameraFovY = gltfScene["cameras"].GetArray()[node.camera.value()]["perspective"]["yfov"].GetFloat();
-            scene.cameraPos = node.totalTransition.apply({0, 0, 0});
-            scene.cameraUp = node.totalTransition.apply(scene.cameraUp) - scene.cameraPos;
-            scene.cameraRight = node.totalTransition.apply(scene.cameraRight) - scene.cameraPos;
-            scene.cameraForward = node.totalTransition.apply(scene.cameraForward) - scene.cameraPos;
+    for (size_t i = 0; i < scene.nodes.size(); i++) {
+        if (scene.nodes[i].camera.has_value()) {
+            scene.cameraNode = i;
         }
     }
+    if (scene.cameraNode.has_value()) {
+        setCameraFromNode(scene, scene.cameraNode.value());
+    }
 }
 
 
+// Images come from files or, in a .glb, from buffer views
 void loadTextureImages(std::string_view gltfFilename, const rapidjson::Document &gltfScene, Scene &scene) {
+    if (!gltfScene.HasMember("images")) {
+        return;
+    }
     const auto &images = gltfScene["images"].GetArray();
-    for (const auto &img : images) {
+    // Color textures are sRGB-encoded, the rest (metallic-roughness, normals) hold linear data
+    std::vector<bool> isSRGB(images.Size(), false);
+    for (const auto &material : scene.materials) {
+        for (const auto &texture : {material.baseColorTexture, material.emissiveTexture}) {
+            if (texture.has_value()) {
+                isSRGB[scene.textureDescs[texture.value()].source] = true;
+            }
+        }
+    }
+
+    scene.textureCache.resize(images.Size());
+    #pragma omp taskloop grainsize(1) default(shared)
+    for (size_t i = 0; i < images.Size(); i++) {
+        if (images[i].HasMember("bufferView")) {
+            const auto &bufferView = scene.bufferViews[images[i]["bufferView"].GetUint()];
+            const auto &buffer = scene.buffers[bufferView.buffer];
+            Buffer encoded;
+            if (bufferView.byteOffset + bufferView.byteLength <= buffer.size()) {
+                encoded = buffer.slice(bufferView.byteOffset, bufferView.byteLength);
+            }
+            if (!scene.textureCache.assign(i, encoded, isSRGB[i])) {
+                #pragma omp critical
+                std::cerr << "Cannot load embedded texture " << i << std::endl;
+            }
+            continue;
+        }
         const auto gltfFilePath = std::filesystem::path(gltfFilename);
-        const auto imgFilePath = gltfFilePath.parent_path().append(img["uri"].GetString());
-        scene.textureImages.push_back(loadTexture(imgFilePath.string()));
+        const auto imgFilePath = gltfFilePath.parent_path().append(images[i]["uri"].GetString());
+        if (!scene.textureCache.assign(i, imgFilePath.string(), isSRGB[i])) {
+            #pragma omp critical
+            std::cerr << "Cannot load texture " << imgFilePath << std::endl;
+        }
     }
 }
 
 void loadTextureDescs(const rapidjson::Document &gltfScene, Scene &scene) {
+    if (!gltfScene.HasMember("textures")) {
+        return;
+    }
     const auto &textures = gltfScene["textures"].GetArray();
     for (const auto &texture : textures) {
         scene.textureDescs.push_back(TextureDesc{
@@ -345,60 +464,268 @@ void loadTextureDescs(const rapidjson::Document &gltfScene, Scene &scene) {
     }
 }
 
-Scene loadScene(std::string_view gltfFilename) {
-    Scene scene;
+// A field of /proc/self/status in KiB, 0 where there is none
+static size_t statusKiB(const char *field) {
+    std::ifstream status("/proc/self/status");
+    std::string line;
+    size_t length = strlen(field);
+    while (std::getline(status, line)) {
+        if (line.compare(0, length, field) == 0 && line.size() > length && line[length] == ':') {
+            return strtoull(line.c_str() + length + 1, nullptr, 10);
+        }
+    }
+    return 0;
+}
+
+// Rendering needs only figures, materials and textures: the glTF buffers and the tables indexing them are freed
+static void releaseSources(Scene &scene) {
+    std::vector<Buffer>().swap(scene.buffers);
+    std::vector<BufferView>().swap(scene.bufferViews);
+    std::vector<Accessor>().swap(scene.accessors);
+    std::vector<Mesh>().swap(scene.meshes);
+}
+
+/**
+ * Timing and memory of one loading stage. Resident set size is sampled when the stage ends, with the
+ * process peak so far; stages running side by side share both.
+ */
+struct LoadStage {
+    const char *name;
+    std::chrono::steady_clock::time_point start, end;
+    size_t residentKiB = 0, peakKiB = 0;
+
+    LoadStage(const char *name): name(name) {}
+
+    template <typename F>
+    void run(F f) {
+        start = std::chrono::steady_clock::now();
+        f();
+        end = std::chrono::steady_clock::now();
+        residentKiB = statusKiB("VmRSS");
+        peakKiB = statusKiB("VmHWM");
+    }
+};
+
+// Prints the stages that ran, relative to start; ready is when the scene could take its first ray
+static void printStages(std::chrono::steady_clock::time_point start, std::chrono::steady_clock::time_point ready, std::initializer_list<const LoadStage*> stages) {
+    auto ms = [start](std::chrono::steady_clock::time_point t) {
+        return std::chrono::duration<double, std::milli>(t - start).count();
+    };
+    std::cerr << "Scene loaded in " << std::fixed << std::setprecision(1) << ms(ready) << " ms" << std::endl;
+    for (const auto *stage : stages) {
+        if (stage->end == std::chrono::steady_clock::time_point()) {
+            continue;
+        }
+        std::cerr << "  " << std::left << std::setw(10) << stage->name << std::right
+                  << std::setw(8) << ms(stage->start) << " .. " << std::setw(8) << ms(stage->end) << " ms"
+                  << std::setw(8) << stage->residentKiB / 1024.0 << " MiB resident"
+                  << std::setw(8) << stage->peakKiB / 1024.0 << " MiB peak" << std::endl;
+    }
+    std::cerr.unsetf(std::ios::floatfield);
+    std::cerr << std::setprecision(6);
+}
 
-    std::ifstream in(gltfFilename.data(), std::ios_base::binary);
-    rapidjson::IStreamWrapper isw(in);
+// Content hash of the scene file and of every buffer and image file it names
+static uint64_t inputHash(std::string_view gltfFilename, const Buffer &file, const rapidjson::Document &gltfScene) {
+    uint64_t hash = scene_cache::hashBytes(file.data(), file.size(), scene_cache::VERSION);
+    for (const char *member : {"buffers", "images"}) {
+        if (!gltfScene.HasMember(member)) {
+            continue;
+        }
+        for (const auto &spec : gltfScene[member].GetArray()) {
+            if (!spec.HasMember("uri")) {
+                continue;
+            }
+            const auto path = std::filesystem::path(gltfFilename).parent_path().append(spec["uri"].GetString());
+            auto input = Buffer::map(path.string());
+            hash = input.has_value() ? scene_cache::hashBytes(input.value().data(), input.value().size(), hash) : ~hash;
+        }
+    }
+    return hash;
+}
+
+/**
+ * Stages run as a task graph: buffers load alongside the JSON-only metadata, texture headers (which may
+ * live in buffers) and triangles follow once both are in, then the BVH and the light distribution are built side by side.
+ * The BVH leaves the figures in place, so both read them unchanged and the figures are put in leaf order last.
+ *
+ * With a cache directory, a scene cache matching the inputs replaces all stages after parsing;
+ * otherwise one is written once the scene is complete.
+ */
+bool loadScene(std::string_view gltfFilename, Scene &scene, const std::string &cacheDir) {
+    LoadStage parse{"parse"}, cacheRead{"cache"}, buffers{"buffers"}, metadata{"metadata"}, images{"images"};
+    LoadStage triangles{"triangles"}, bvh{"bvh"}, lights{"lights"}, reorder{"reorder"}, release{"release"}, cacheWrite{"store"};
+    auto start = std::chrono::steady_clock::now();
+
+    // The whole file is mapped once; JSON is parsed straight from the mapping
+    std::optional<Buffer> file;
+    std::optional<GltfSource> source;
     rapidjson::Document gltfScene;
-    gltfScene.ParseStream(isw);
-
-    loadBuffers(gltfFilename, gltfScene, scene);
-    loadTextureImages(gltfFilename, gltfScene, scene);
-    loadBufferViews(gltfScene, scene);
-    loadNodes(gltfScene, scene);
-    restoreNodeParents(scene);
-    calculateTransitions(scene);
-    loadMeshes(gltfScene, scene);
-    loadAccessors(gltfScene, scene);
-    loadMaterials(gltfScene, scene);
-    loadFiguresFromNodes(scene);
-    loadCameraPosition(gltfScene, scene);
-    loadTextureDescs(gltfScene, scene);
-
-    scene.initBVH();
-    scene.initDistribution();
+    parse.run([&]() {
+        file = Buffer::map(std::string(gltfFilename));
+        if (file.has_value()) {
+            source = splitGltf(file.value());
+        } else {
+            std::cerr << "Cannot open scene " << gltfFilename << std::endl;
+        }
+        if (source.has_value()) {
+            gltfScene.Parse(source.value().json.data(), source.value().json.size());
+        }
+    });
+    if (!source.has_value() || gltfScene.HasParseError()) {
+        std::cerr << "Cannot parse scene " << gltfFilename << std::endl;
+        return false;
+    }
+
+    std::string cachePath;
+    uint64_t key = 0;
+    if (!cacheDir.empty()) {
+        bool hit = false;
+        cacheRead.run([&]() {
+            key = inputHash(gltfFilename, file.value(), gltfScene);
+            char name[32];
+            snprintf(name, sizeof(name), "%016llx.scene", static_cast<unsigned long long>(key));
+            cachePath = (std::filesystem::path(cacheDir) / name).string();
+            hit = scene_cache::load(cachePath, key, scene);
+        });
+        if (hit) {
+            printStages(start, cacheRead.end, {&parse, &cacheRead});
+            return true;
+        }
+    }
+
+    std::vector<uint32_t> order;
+    #pragma omp parallel
+    #pragma omp single
+    {
+        #pragma omp task depend(out: buffers)
+        buffers.run([&]() {
+            loadBuffers(gltfFilename, gltfScene, source.value().bin, scene);
+        });
+        #pragma omp task depend(out: metadata)
+        metadata.run([&]() {
+            loadBufferViews(gltfScene, scene);
+            loadNodes(gltfScene, scene);
+            restoreNodeParents(scene);
+            calculateTransitions(scene);
+            loadMeshes(gltfScene, scene);
+            loadAccessors(gltfScene, scene);
+            loadMaterials(gltfScene, scene);
+            loadCameras(gltfScene, scene);
+            loadCameraPosition(scene);
+            loadTextureDescs(gltfScene, scene);
+        });
+        #pragma omp task depend(in: buffers, metadata) depend(out: images)
+        images.run([&]() {
+            loadTextureImages(gltfFilename, gltfScene, scene);
+        });
+        #pragma omp task depend(in: buffers, metadata) depend(out: triangles)
+        triangles.run([&]() {
+            loadFiguresFromNodes(scene);
+        });
+        #pragma omp task depend(in: triangles) depend(out: bvh)
+        bvh.run([&]() {
+            scene.bvh = BVH(scene.figures, order);
+        });
+        #pragma omp task depend(in: triangles, images) depend(out: lights)
+        lights.run([&]() {
+            scene.initDistribution();
+        });
+    }
+    reorder.run([&]() {
+        scene.reorderFigures(order);
+    });
+    release.run([&]() {
+        releaseSources(scene);
+        std::vector<uint32_t>().swap(order);
+    });
+
+    if (!cachePath.empty()) {
+        cacheWrite.run([&]() {
+            std::error_code error;
+            std::filesystem::create_directories(cacheDir, error);
+            scene_cache::save(cachePath, key, scene);
+        });
+    }
+    printStages(start, release.end, {&parse, &cacheRead, &buffers, &metadata, &images, &triangles, &bvh, &lights, &reorder, &release, &cacheWrite});
+    return true;
+}
+
+Scene loadScene(std::string_view gltfFilename, const std::string &cacheDir) {
+    Scene scene;
+    loadScene(gltfFilename, scene, cacheDir);
     return scene;
 }
 
-Texture loadTexture(std::string_view file) {
-    Texture result;
-    int channels;
-    result.data = reinterpret_cast<uint8_t*>(stbi_load(file.data(), &result.width, &result.height, &channels, 3));
+std::optional<Texture> loadTexture(std::string_view file, bool isSRGB) {
+    int width, height, channels;
+    uint8_t *data = reinterpret_cast<uint8_t*>(stbi_load(file.data(), &width, &height, &channels, 3));
+    if (data == nullptr) {
+        return {};
+    }
+    Texture result(width, height, data, isSRGB, true);
+    stbi_image_free(data);
     return result;
 }
 
-void renderScene(Scene &scene, std::string_view outFileName) {
-    std::ofstream out(outFileName.data(), std::ios::binary);
+bool renderScene(Scene &scene, std::string_view outFileName) {
+    std::ofstream out(std::string(outFileName), std::ios::binary);
+    if (!out.is_open()) {
+        std::cerr << "Cannot create " << outFileName << std::endl;
+        return false;
+    }
     out << "P6\n";
     out << scene.width << ' ' << scene.height << '\n';
     out << 255 << '\n';
-    std::array<uint8_t, 3> result[scene.height][scene.width];
-    #pragma omp parallel for schedule(dynamic,8)
-    for (int i = 0; i < scene.height * scene.width; i++) {
-        rng_type rng(i);
-        int x = i % scene.width;
-        int y = i / scene.width;
-        auto pixel0 = scene.getPixel(rng, x, y);
-        result[y][x] = toExternColorFormat(
-            gamma_corrected(aces_tonemap(pixel0))
-        );
-    }
-    for (int y = 0; y < scene.height; y++) {
-        for (int x = 0; x < scene.width; x++) {
-            out.write(reinterpret_cast<char*>(result[y][x].data()), 3);
+
+    // Rows are taken dynamically by the workers and flushed to the file in order
+    // through a ring of RESIDENT_ROWS_PER_THREAD * threads row slots, so memory
+    // does not grow with the image height.
+    size_t rowBytes = 3 * static_cast<size_t>(scene.width);
+    int slots = std::min<int>(scene.height, RESIDENT_ROWS_PER_THREAD * std::max(1u, std::thread::hardware_concurrency()));
+    std::vector<uint8_t> rows(rowBytes * slots);
+    std::vector<char> rowDone(slots, false);
+    std::atomic<int> nextRow = 0;
+    int nextToWrite = 0;
+    std::mutex mutex;
+    std::condition_variable slotFreed;
+
+    #pragma omp parallel
+    {
+        for (int y = nextRow++; y < scene.height; y = nextRow++) {
+            {
+                std::unique_lock lock(mutex);
+                slotFreed.wait(lock, [&]() { return y < nextToWrite + slots; });
+            }
+            uint8_t *row = rows.data() + rowBytes * (y % slots);
+            for (int x = 0; x < scene.width; x++) {
+                auto pixel = toExternColorFormat(
+                    gamma_corrected(aces_tonemap(scene.getPixel(x, y)))
+                );
+                std::copy(pixel.begin(), pixel.end(), row + 3 * x);
+            }
+
+            std::lock_guard lock(mutex);
+            rowDone[y % slots] = true;
+            bool flushed = false;
+            while (nextToWrite < scene.height && rowDone[nextToWrite % slots]) {
+                out.write(reinterpret_cast<char*>(rows.data() + rowBytes * (nextToWrite % slots)), rowBytes);
+                rowDone[nextToWrite % slots] = false;
+                nextToWrite++;
+                flushed = true;
+            }
+            if (flushed) {
+                slotFreed.notify_all();
+            }
         }
     }
+
+    out.close();
+    if (!out.good()) {
+        std::cerr << "Cannot write " << outFileName << std::endl;
+        return false;
+    }
+    return true;
 }
 
 }
\ No newline at end of file
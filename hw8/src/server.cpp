@@ -0,0 +1,367 @@
+#include "server.h"
+#include "scene.h"
+#include "sceneio.h"
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <cctype>
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <string>
+
+namespace server {
+
+namespace {
+
+// The camera as loaded, restored before every job so that one job's overrides never leak into the next
+struct Camera {
+    Vec3 pos, up, right, forward;
+    float fovY;
+
+    static Camera of(const Scene &scene) {
+        return {scene.cameraPos, scene.cameraUp, scene.cameraRight, scene.cameraForward, scene.cameraFovY};
+    }
+
+    void applyTo(Scene &scene) const {
+        scene.cameraPos = pos;
+        scene.cameraUp = up;
+        scene.cameraRight = right;
+        scene.cameraForward = forward;
+        scene.cameraFovY = fovY;
+    }
+};
+
+// Resident scenes and converted environment maps; past these counts the least recently used one is dropped
+const size_t MAX_SCENES = 4;
+const size_t MAX_ENVIRONMENT_MAPS = 4;
+
+// Jobs are served one at a time, so a client that never finishes its request line must not hold up the rest
+const int REQUEST_TIMEOUT_MS = 5000;
+const size_t MAX_REQUEST_LENGTH = 4096;
+
+struct CachedScene {
+    std::filesystem::file_time_type sceneTime;
+    std::unique_ptr<Scene> scene;
+    Camera camera;
+    // The environment map currently attached, empty path for none
+    std::string envPath;
+    std::filesystem::file_time_type envTime;
+    uint64_t lastUse = 0;
+};
+
+struct CachedEnvironmentMap {
+    std::filesystem::file_time_type time;
+    EnvironmentMap map;
+    uint64_t lastUse = 0;
+};
+
+// Makes room for one more entry
+template <typename Entry>
+void evictLeastRecentlyUsed(std::map<std::string, Entry> &entries, size_t limit) {
+    while (!entries.empty() && entries.size() >= limit) {
+        auto oldest = entries.begin();
+        for (auto it = entries.begin(); it != entries.end(); ++it) {
+            if (it->second.lastUse < oldest->second.lastUse) {
+                oldest = it;
+            }
+        }
+        std::cerr << "Evicting " << oldest->first << std::endl;
+        entries.erase(oldest);
+    }
+}
+
+using Request = std::map<std::string, std::string>;
+
+Request parseRequest(const std::string &line) {
+    Request request;
+    std::istringstream in(line);
+    std::string token;
+    while (in >> token) {
+        auto pos = token.find('=');
+        if (pos == std::string::npos) {
+            request[token] = "";
+        } else {
+            request[token.substr(0, pos)] = token.substr(pos + 1);
+        }
+    }
+    return request;
+}
+
+bool parseVec3(const std::string &value, Vec3 &result) {
+    return sscanf(value.c_str(), "%f,%f,%f", &result.x, &result.y, &result.z) == 3;
+}
+
+bool parseInt(const Request &request, const std::string &key, int &result) {
+    auto it = request.find(key);
+    if (it == request.end()) {
+        return false;
+    }
+    char *end;
+    result = strtol(it->second.c_str(), &end, 10);
+    return *end == '\0' && result > 0;
+}
+
+class SceneCache {
+private:
+    std::map<std::string, CachedScene> scenes;
+    std::map<std::string, CachedEnvironmentMap> environmentMaps;
+    uint64_t useCount = 0;
+
+    const EnvironmentMap *getEnvironmentMap(const std::string &envPath, std::filesystem::file_time_type envTime, std::string &error) {
+        auto it = environmentMaps.find(envPath);
+        if (it != environmentMaps.end() && it->second.time == envTime) {
+            it->second.lastUse = ++useCount;
+            return &it->second.map;
+        }
+        if (it != environmentMaps.end()) {
+            std::cerr << "Reloading modified environment map " << envPath << std::endl;
+            environmentMaps.erase(it);
+        }
+
+        auto texture = sceneio::loadTexture(envPath, true);
+        if (!texture.has_value()) {
+            error = "cannot load environment map " + envPath;
+            return nullptr;
+        }
+        evictLeastRecentlyUsed(environmentMaps, MAX_ENVIRONMENT_MAPS);
+        auto &entry = environmentMaps[envPath];
+        entry = CachedEnvironmentMap{envTime, Scene::toEnvironmentMap(texture.value()), ++useCount};
+        return &entry.map;
+    }
+
+public:
+    // The scene is keyed on its own path; the job's environment map is attached to it on the way out
+    CachedScene *get(const std::string &scenePath, const std::string &envPath, std::string &error) {
+        std::error_code ec;
+        auto sceneTime = std::filesystem::last_write_time(scenePath, ec);
+        if (ec) {
+            error = "cannot stat scene " + scenePath;
+            return nullptr;
+        }
+        std::filesystem::file_time_type envTime;
+        if (!envPath.empty()) {
+            envTime = std::filesystem::last_write_time(envPath, ec);
+            if (ec) {
+                error = "cannot stat environment map " + envPath;
+                return nullptr;
+            }
+        }
+
+        auto it = scenes.find(scenePath);
+        if (it != scenes.end() && it->second.sceneTime != sceneTime) {
+            std::cerr << "Reloading modified scene " << scenePath << std::endl;
+            scenes.erase(it);
+            it = scenes.end();
+        }
+        if (it == scenes.end()) {
+            auto scene = std::make_unique<Scene>();
+            if (!sceneio::loadScene(scenePath, *scene)) {
+                error = "cannot load scene " + scenePath;
+                return nullptr;
+            }
+            evictLeastRecentlyUsed(scenes, MAX_SCENES);
+            Camera camera = Camera::of(*scene);
+            it = scenes.emplace(scenePath, CachedScene{sceneTime, std::move(scene), camera, "", {}, 0}).first;
+        }
+        CachedScene &cached = it->second;
+        cached.lastUse = ++useCount;
+
+        if (cached.envPath != envPath || cached.envTime != envTime) {
+            if (envPath.empty()) {
+                cached.scene->setEnvironmentMap(std::nullopt);
+            } else {
+                const EnvironmentMap *environmentMap = getEnvironmentMap(envPath, envTime, error);
+                if (environmentMap == nullptr) {
+                    return nullptr;
+                }
+                cached.scene->setEnvironmentMap(*environmentMap);
+            }
+            cached.envPath = envPath;
+            cached.envTime = envTime;
+        }
+        return &cached;
+    }
+};
+
+bool applyCamera(CachedScene &cached, const Request &request, std::string &error) {
+    Scene &scene = *cached.scene;
+    cached.camera.applyTo(scene);
+    auto node = request.find("node");
+    if (node != request.end()) {
+        char *end;
+        size_t nodeIndex = strtoul(node->second.c_str(), &end, 10);
+        if (node->second.empty() || !isdigit(static_cast<unsigned char>(node->second[0])) || *end != '\0') {
+            error = "malformed node " + node->second;
+            return false;
+        }
+        if (!sceneio::setCameraFromNode(scene, nodeIndex)) {
+            error = "node " + node->second + " is not a camera node";
+            return false;
+        }
+    }
+
+    auto eye = request.find("eye");
+    if (eye == request.end()) {
+        return true;
+    }
+    Vec3 pos, forward, up{0, 1, 0};
+    if (!parseVec3(eye->second, pos) || !request.count("forward") || !parseVec3(request.at("forward"), forward)) {
+        error = "eye override needs eye=x,y,z and forward=x,y,z";
+        return false;
+    }
+    if (request.count("up") && !parseVec3(request.at("up"), up)) {
+        error = "malformed up vector";
+        return false;
+    }
+    scene.cameraPos = pos;
+    scene.cameraForward = forward.normalize();
+    scene.cameraRight = up.cross(scene.cameraForward).normalize();
+    scene.cameraUp = scene.cameraForward.cross(scene.cameraRight);
+    if (request.count("fovy")) {
+        scene.cameraFovY = strtof(request.at("fovy").c_str(), nullptr);
+    }
+    return true;
+}
+
+std::string handle(SceneCache &cache, const Request &request) {
+    if (!request.count("scene") || !request.count("out")) {
+        return "ERROR request needs scene= and out=";
+    }
+    int width = 0, height = 0, samples = 0;
+    if (!parseInt(request, "width", width) || !parseInt(request, "height", height) || !parseInt(request, "samples", samples)) {
+        return "ERROR request needs positive width=, height= and samples=";
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    std::string error;
+    auto envPath = request.count("env") ? request.at("env") : "";
+    CachedScene *cached = cache.get(request.at("scene"), envPath, error);
+    if (cached == nullptr) {
+        return "ERROR " + error;
+    }
+    Scene *scene = cached->scene.get();
+    if (!applyCamera(*cached, request, error)) {
+        return "ERROR " + error;
+    }
+    scene->width = width;
+    scene->height = height;
+    scene->samples = samples;
+    scene->samplerType = SamplerType::Sobol;
+    if (request.count("sampler")) {
+        auto samplerType = samplerTypeFromString(request.at("sampler"));
+        if (!samplerType.has_value()) {
+            return "ERROR unknown sampler " + request.at("sampler");
+        }
+        scene->samplerType = samplerType.value();
+    }
+    scene->integrator = Integrator::Mix;
+    if (request.count("integrator")) {
+        auto integrator = integratorFromString(request.at("integrator"));
+        if (!integrator.has_value()) {
+            return "ERROR unknown integrator " + request.at("integrator");
+        }
+        scene->integrator = integrator.value();
+    }
+    if (!sceneio::renderScene(*scene, request.at("out"))) {
+        return "ERROR cannot write " + request.at("out");
+    }
+
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    return "OK " + std::to_string(elapsed.count());
+}
+
+// Fails with an error message when the whole line does not arrive within REQUEST_TIMEOUT_MS or is too long
+bool readLine(int fd, std::string &line, std::string &error) {
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(REQUEST_TIMEOUT_MS);
+    char c;
+    while (true) {
+        auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+        pollfd pfd{fd, POLLIN, 0};
+        if (remaining.count() <= 0 || poll(&pfd, 1, remaining.count()) <= 0) {
+            error = "request timed out";
+            return false;
+        }
+        ssize_t n = recv(fd, &c, 1, 0);
+        if (n <= 0) {
+            return !line.empty();
+        }
+        if (c == '\n') {
+            return true;
+        }
+        if (line.size() == MAX_REQUEST_LENGTH) {
+            error = "request line is too long";
+            return false;
+        }
+        line.push_back(c);
+    }
+}
+
+}
+
+int serve(std::string_view socketPath) {
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (socketPath.size() >= sizeof(addr.sun_path)) {
+        std::cerr << "Socket path is too long: " << socketPath << std::endl;
+        return 1;
+    }
+    memcpy(addr.sun_path, socketPath.data(), socketPath.size());
+
+    int listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listenFd < 0) {
+        std::cerr << "socket: " << strerror(errno) << std::endl;
+        return 1;
+    }
+    unlink(addr.sun_path);
+    if (bind(listenFd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0 || listen(listenFd, 16) < 0) {
+        std::cerr << "Cannot listen on " << socketPath << ": " << strerror(errno) << std::endl;
+        close(listenFd);
+        return 1;
+    }
+    std::cerr << "Listening on " << socketPath << std::endl;
+
+    // Jobs are served one at a time; each render spreads over the OpenMP
+    // worker pool, which stays alive between jobs.
+    SceneCache cache;
+    bool running = true;
+    while (running) {
+        int fd = accept(listenFd, nullptr, nullptr);
+        if (fd < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            std::cerr << "accept: " << strerror(errno) << std::endl;
+            break;
+        }
+        std::string line, response, error;
+        if (readLine(fd, line, error)) {
+            if (line == "shutdown") {
+                running = false;
+                response = "OK";
+            } else {
+                response = handle(cache, parseRequest(line));
+            }
+            std::cerr << line << " -> " << response << std::endl;
+        } else if (!error.empty()) {
+            response = "ERROR " + error;
+            std::cerr << response << std::endl;
+        }
+        if (!response.empty()) {
+            response.push_back('\n');
+            send(fd, response.data(), response.size(), MSG_NOSIGNAL);
+        }
+        close(fd);
+    }
+
+    close(listenFd);
+    unlink(addr.sun_path);
+    return 0;
+}
+
+}
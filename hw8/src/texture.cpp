@@ -0,0 +1,87 @@
+#include "texture.h"
+#include <algorithm>
+#include <cmath>
+
+static const std::array<float, 256> &srgbTable() {
+    static const auto table = []() {
+        std::array<float, 256> result;
+        for (int i = 0; i < 256; i++) {
+            result[i] = std::pow(i / 255.f, 2.2f);
+        }
+        return result;
+    }();
+    return table;
+}
+
+static const std::array<float, 256> &unormTable() {
+    static const auto table = []() {
+        std::array<float, 256> result;
+        for (int i = 0; i < 256; i++) {
+            result[i] = i / 255.f;
+        }
+        return result;
+    }();
+    return table;
+}
+
+const std::array<float, 256> &Texture::decodeTable(bool isSRGB) {
+    return isSRGB ? srgbTable() : unormTable();
+}
+
+void Texture::storeLevel(Level &level, const std::vector<float> &values, bool asFloat) const {
+    if (asFloat) {
+        level.linear = values;
+        return;
+    }
+    level.codes.resize(values.size());
+    for (size_t i = 0; i < values.size(); i++) {
+        float v = std::clamp(values[i], 0.f, 1.f);
+        level.codes[i] = std::lround(255 * (isSRGB ? std::pow(v, 1 / 2.2f) : v));
+    }
+}
+
+Texture::Texture(int width, int height, const uint8_t *rgb, bool isSRGB, bool asFloat)
+    : decode(&decodeTable(isSRGB)), isSRGB(isSRGB), width(width), height(height) {
+    std::vector<float> values(3 * static_cast<size_t>(width) * height);
+    for (size_t i = 0; i < values.size(); i++) {
+        values[i] = (*decode)[rgb[i]];
+    }
+
+    levels.push_back(Level{width, height, {}, {}});
+    if (asFloat) {
+        levels.back().linear = values;
+    } else {
+        // Keep the original codes instead of re-encoding the decoded values
+        levels.back().codes.assign(rgb, rgb + values.size());
+    }
+
+    // Box filter in linear space; with an odd size the leftover row or column joins the last output texel
+    int w = width, h = height;
+    while (w > 1 || h > 1) {
+        int nextW = std::max(1, w / 2), nextH = std::max(1, h / 2);
+        std::vector<float> next(3 * static_cast<size_t>(nextW) * nextH, 0);
+        std::vector<int> count(static_cast<size_t>(nextW) * nextH, 0);
+        for (int iy = 0; iy < h; iy++) {
+            int ny = std::min(iy / (h / nextH), nextH - 1);
+            for (int ix = 0; ix < w; ix++) {
+                int nx = std::min(ix / (w / nextW), nextW - 1);
+                size_t pos = nx + static_cast<size_t>(nextW) * ny;
+                count[pos]++;
+                for (int c = 0; c < 3; c++) {
+                    next[3 * pos + c] += values[3 * (ix + static_cast<size_t>(w) * iy) + c];
+                }
+            }
+        }
+        for (size_t pos = 0; pos < count.size(); pos++) {
+            for (int c = 0; c < 3; c++) {
+                next[3 * pos + c] /= count[pos];
+            }
+        }
+
+        levels.push_back(Level{nextW, nextH, {}, {}});
+        storeLevel(levels.back(), next, asFloat);
+        values = std::move(next);
+        w = nextW;
+        h = nextH;
+    }
+}
@@ -0,0 +1,206 @@
+#include "texture_cache.h"
+#include "stb_image.h"
+#include <algorithm>
+
+void TextureCache::resize(size_t count) {
+    images.resize(count);
+}
+
+bool TextureCache::assign(size_t index, const std::string &path, bool isSRGB) {
+    Image &image = images[index];
+    image.path = path;
+    int channels;
+    return initImage(image, stbi_info(path.c_str(), &image.width, &image.height, &channels) != 0, isSRGB);
+}
+
+bool TextureCache::assign(size_t index, const Buffer &encoded, bool isSRGB) {
+    Image &image = images[index];
+    image.encoded = encoded;
+    int channels;
+    bool ok = stbi_info_from_memory(reinterpret_cast<const stbi_uc*>(encoded.data()), encoded.size(), &image.width, &image.height, &channels) != 0;
+    return initImage(image, ok, isSRGB);
+}
+
+bool TextureCache::initImage(Image &image, bool ok, bool isSRGB) {
+    image.isSRGB = isSRGB;
+    image.decode = &Texture::decodeTable(isSRGB);
+    if (!ok) {
+        image.path.clear();
+        image.encoded = Buffer();
+        image.width = image.height = 1;
+    }
+    initLevels(image);
+    return ok;
+}
+
+void TextureCache::initLevels(Image &image) {
+    image.levels.clear();
+    image.pageCount = 0;
+    int w = image.width, h = image.height;
+    while (true) {
+        int pagesX = (w + PAGE - 1) >> PAGE_LOG, pagesY = (h + PAGE - 1) >> PAGE_LOG;
+        image.levels.push_back(Level{w, h, pagesX, image.pageCount});
+        image.pageCount += pagesX * pagesY;
+        if (w == 1 && h == 1) {
+            break;
+        }
+        w = std::max(1, w / 2);
+        h = std::max(1, h / 2);
+    }
+    image.pageTable = std::make_unique<std::atomic<uint32_t>[]>(image.pageCount);
+    for (uint32_t i = 0; i < image.pageCount; i++) {
+        image.pageTable[i].store(NO_SLOT, std::memory_order_relaxed);
+    }
+    image.loading = std::make_unique<std::mutex>();
+}
+
+Texture TextureCache::decodeImage(const Image &img) {
+    std::vector<uint8_t> rgb;
+    if (!img.path.empty() || img.encoded.size() > 0) {
+        int width, height, channels;
+        uint8_t *data = img.encoded.size() > 0
+            ? stbi_load_from_memory(reinterpret_cast<const stbi_uc*>(img.encoded.data()), img.encoded.size(), &width, &height, &channels, 3)
+            : stbi_load(img.path.c_str(), &width, &height, &channels, 3);
+        if (data != nullptr && width == img.width && height == img.height) {
+            rgb.assign(data, data + 3 * static_cast<size_t>(width) * height);
+        }
+        stbi_image_free(data);
+    }
+    if (rgb.empty()) {
+        rgb.assign(3 * static_cast<size_t>(img.width) * img.height, 255);
+    }
+    return Texture(img.width, img.height, rgb.data(), img.isSRGB, false);
+}
+
+void TextureCache::copyPage(const Image &img, uint32_t page, const Texture &decoded, uint8_t *data) {
+    int level = levelOf(img, page);
+    const Level &l = img.levels[level];
+    int pageX = (page - l.firstPage) % l.pagesX, pageY = (page - l.firstPage) / l.pagesX;
+    for (int ly = 0; ly < PAGE && pageY * PAGE + ly < l.height; ly++) {
+        for (int lx = 0; lx < PAGE && pageX * PAGE + lx < l.width; lx++) {
+            std::copy_n(decoded.codesAt(pageX * PAGE + lx, pageY * PAGE + ly, level), 3, data + pageOffset(lx, ly));
+        }
+    }
+}
+
+std::vector<uint8_t> TextureCache::decodePages(size_t image) const {
+    const Image &img = images[image];
+    if (img.pages.size() > 0) {
+        return std::vector<uint8_t>(img.pages.data(), img.pages.data() + img.pages.size());
+    }
+    std::vector<uint8_t> pages(img.pageCount * PAGE_BYTES, 0);
+    Texture decoded = decodeImage(img);
+    for (uint32_t page = 0; page < img.pageCount; page++) {
+        copyPage(img, page, decoded, pages.data() + page * PAGE_BYTES);
+    }
+    return pages;
+}
+
+void TextureCache::load(size_t image, uint32_t page) const {
+    const Image &img = images[image];
+    std::lock_guard<std::mutex> loading(*img.loading);
+    if (img.pageTable[page].load(std::memory_order_acquire) != NO_SLOT) {
+        return;
+    }
+
+    Texture decoded = decodeImage(img);
+
+    std::lock_guard<std::mutex> lock(*mutex);
+    decodes++;
+    if (!slots) {
+        slotCount = std::max<size_t>(1, std::min<size_t>(budget / PAGE_BYTES, NO_SLOT - 1));
+        slots = std::make_unique<Slot[]>(slotCount);
+        // Not value-initialized, so untouched slots cost no resident memory
+        pool.reset(new uint8_t[slotCount * PAGE_BYTES]);
+    }
+    // The rest of the image is installed speculatively, nearest levels first, into slots nobody
+    // referenced since the last sweep, so a decode never pushes out pages in use
+    install(image, page, decoded, evict(), true);
+    int requestedLevel = levelOf(img, page);
+    std::vector<int> order;
+    for (int level = requestedLevel; level < static_cast<int>(img.levels.size()); level++) {
+        order.push_back(level);
+    }
+    for (int level = requestedLevel - 1; level >= 0; level--) {
+        order.push_back(level);
+    }
+    for (int level : order) {
+        uint32_t first = img.levels[level].firstPage;
+        uint32_t last = level + 1 < static_cast<int>(img.levels.size()) ? img.levels[level + 1].firstPage : img.pageCount;
+        for (uint32_t p = first; p < last; p++) {
+            if (img.pageTable[p].load(std::memory_order_relaxed) != NO_SLOT) {
+                continue;
+            }
+            auto slot = evictUnreferenced();
+            if (!slot.has_value()) {
+                return;
+            }
+            install(image, p, decoded, slot.value(), false);
+        }
+    }
+}
+
+int TextureCache::levelOf(const Image &img, uint32_t page) {
+    int level = 0;
+    while (level + 1 < static_cast<int>(img.levels.size()) && img.levels[level + 1].firstPage <= page) {
+        level++;
+    }
+    return level;
+}
+
+uint32_t TextureCache::evict() const {
+    if (usedSlots < slotCount) {
+        return usedSlots++;
+    }
+    while (true) {
+        uint32_t slot = clockHand;
+        clockHand = clockHand + 1 == slotCount ? 0 : clockHand + 1;
+        if (!slots[slot].referenced.exchange(false, std::memory_order_relaxed)) {
+            return slot;
+        }
+    }
+}
+
+std::optional<uint32_t> TextureCache::evictUnreferenced() const {
+    if (usedSlots < slotCount) {
+        return usedSlots++;
+    }
+    for (uint32_t i = 0; i < slotCount; i++) {
+        uint32_t slot = clockHand;
+        clockHand = clockHand + 1 == slotCount ? 0 : clockHand + 1;
+        if (!slots[slot].referenced.load(std::memory_order_relaxed)) {
+            return slot;
+        }
+    }
+    return {};
+}
+
+void TextureCache::install(size_t image, uint32_t page, const Texture &decoded, uint32_t slot, bool referenced) const {
+    Slot &s = slots[slot];
+    uint64_t old = s.owner.load(std::memory_order_relaxed);
+    if (old != NO_OWNER) {
+        images[old >> 32].pageTable[old & UINT32_MAX].store(NO_SLOT, std::memory_order_relaxed);
+    }
+
+    uint32_t sequence = s.sequence.load(std::memory_order_relaxed);
+    s.sequence.store(sequence + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    const Image &img = images[image];
+    copyPage(img, page, decoded, pool.get() + slot * PAGE_BYTES);
+
+    s.owner.store(ownerKey(image, page), std::memory_order_relaxed);
+    s.sequence.store(sequence + 2, std::memory_order_release);
+    s.referenced.store(referenced, std::memory_order_relaxed);
+    img.pageTable[page].store(slot, std::memory_order_release);
+}
+
+size_t TextureCache::residentBytes() const {
+    std::lock_guard<std::mutex> lock(*mutex);
+    return usedSlots * PAGE_BYTES;
+}
+
+size_t TextureCache::decodeCount() const {
+    std::lock_guard<std::mutex> lock(*mutex);
+    return decodes;
+}
@@ -0,0 +1,81 @@
+#include "scene.h"
+#include "sceneio.h"
+#include <cstring>
+#include <iomanip>
+
+/**
+ * Compares samplers at equal sample counts: prints the RMSE of the displayed image
+ * against a high-spp reference rendered with the random sampler, for spp = 1, 2, 4, ...
+ * The reference draws sample indices from max spp on, so it shares no samples with the
+ * random sampler runs it scores.
+ *
+ * Usage: sampler_convergence <scene.gltf> <width> <height> <reference spp> <max spp> [environment map]
+ */
+
+static std::vector<Color> render(Scene &scene) {
+    std::vector<Color> image(static_cast<size_t>(scene.width) * scene.height);
+    #pragma omp parallel for schedule(dynamic,8)
+    for (int i = 0; i < scene.width * scene.height; i++) {
+        image[i] = gamma_corrected(aces_tonemap(scene.getPixel(i % scene.width, i / scene.width)));
+    }
+    return image;
+}
+
+static float rmse(const std::vector<Color> &image, const std::vector<Color> &reference) {
+    double sum = 0;
+    for (size_t i = 0; i < image.size(); i++) {
+        Color d = image[i] - reference[i];
+        sum += d.len2() / 3;
+    }
+    return std::sqrt(sum / image.size());
+}
+
+int main(int argc, const char *argv[]) {
+    if (argc < 6) {
+        std::cerr << "Usage: " << argv[0] << " <scene.gltf> <width> <height> <reference spp> <max spp> [environment map]" << std::endl;
+        return 1;
+    }
+    Scene scene;
+    if (!sceneio::loadScene(argv[1], scene)) {
+        return 1;
+    }
+    scene.width = strtol(argv[2], nullptr, 10);
+    scene.height = strtol(argv[3], nullptr, 10);
+    int referenceSamples = strtol(argv[4], nullptr, 10);
+    int maxSamples = strtol(argv[5], nullptr, 10);
+    if (argc > 6) {
+        auto environmentMap = sceneio::loadTexture(argv[6], true);
+        if (!environmentMap.has_value()) {
+            std::cerr << "Cannot load environment map: " << argv[6] << std::endl;
+            return 1;
+        }
+        scene.setEnvironmentMap(environmentMap.value());
+    }
+
+    scene.samplerType = SamplerType::Random;
+    scene.samples = referenceSamples;
+    scene.firstSample = maxSamples;
+    auto reference = render(scene);
+    scene.firstSample = 0;
+
+    const std::pair<const char*, SamplerType> samplers[] = {
+        {"random", SamplerType::Random},
+        {"sobol", SamplerType::Sobol},
+        {"halton", SamplerType::Halton}
+    };
+    std::cout << std::setw(6) << "spp";
+    for (const auto &[name, _] : samplers) {
+        std::cout << std::setw(12) << name;
+    }
+    std::cout << std::endl;
+    for (int samples = 1; samples <= maxSamples; samples *= 2) {
+        std::cout << std::setw(6) << samples;
+        for (const auto &[_, type] : samplers) {
+            scene.samplerType = type;
+            scene.samples = samples;
+            std::cout << std::setw(12) << std::fixed << std::setprecision(6) << rmse(render(scene), reference);
+        }
+        std::cout << std::endl;
+    }
+    return 0;
+}
@@ -0,0 +1,228 @@
+#include "primitives.h"
+#include "material.h"
+#include <chrono>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <vector>
+
+/**
+ * Times the ray, intersection and shading kernels against scalar copies of the versions they
+ * replaced, on random inputs, and prints ns per call and the speedup.
+ *
+ * Usage: vec_benchmark [iterations]
+ */
+
+namespace reference {
+
+std::optional<std::pair<float, bool>> intersectBox(const AABB &box, const Ray &ray_) {
+    Vec3 s = 0.5 * (box.max - box.min);
+    Ray ray = ray_ - 0.5 * (box.min + box.max);
+    Vec3 ts1 = (-1. * s - ray.o) / ray.d;
+    Vec3 ts2 = (s - ray.o) / ray.d;
+    float t1x = std::min(ts1.x, ts2.x), t2x = std::max(ts1.x, ts2.x);
+    float t1y = std::min(ts1.y, ts2.y), t2y = std::max(ts1.y, ts2.y);
+    float t1z = std::min(ts1.z, ts2.z), t2z = std::max(ts1.z, ts2.z);
+    float t1 = std::max(std::max(t1x, t1y), t1z);
+    float t2 = std::min(std::min(t2x, t2y), t2z);
+    if (t1 > t2 || t2 < 0) {
+        return {};
+    }
+    if (t1 < 0) {
+        return {{t2, true}};
+    }
+    return {{t1, false}};
+}
+
+static const float magic1[] = {0.239, 0.419, 0.533};
+static const float magic2[] = {0.35743, 0.66682, 0.69695};
+
+// Every candidate triangle was fully interpolated before the closest one was known
+std::optional<Intersection> intersectTriangle(const Figure &fig, const Ray &ray) {
+    const Vec3 &a = fig.data3.coords;
+    const Vec3 &b = fig.data.coords - a;
+    const Vec3 &c = fig.data2.coords - a;
+    Vec3 n = b.cross(c);
+    Vec3 o = ray.o - a;
+    float t = -o.dot(n) / ray.d.dot(n);
+    if (!(t > 0 && t < 1e4)) {
+        return {};
+    }
+    bool isInside = ray.d.dot(n) > 0;
+    Vec3 geomNorma = isInside ? -1. * n : n;
+    Vec3 p = o + t * ray.d;
+
+    auto a1 = magic1[0] * b.x + magic1[1] * b.y + magic1[2] * b.z;
+    auto b1 = magic1[0] * c.x + magic1[1] * c.y + magic1[2] * c.z;
+    auto c1 = magic1[0] * p.x + magic1[1] * p.y + magic1[2] * p.z;
+    auto a2 = magic2[0] * b.x + magic2[1] * b.y + magic2[2] * b.z;
+    auto b2 = magic2[0] * c.x + magic2[1] * c.y + magic2[2] * c.z;
+    auto c2 = magic2[0] * p.x + magic2[1] * p.y + magic2[2] * p.z;
+    float v = (c1 * a2 - c2 * a1) / (b1 * a2 - a1 * b2);
+    float u = a2 == 0 ? (c1 - b1 * v) / a1 : (c2 - b2 * v) / a2;
+    if (u < 0 || v < 0 || u + v > 1) {
+        return {};
+    }
+
+    Vec3 n1 = fig.data.normal(), n2 = fig.data2.normal(), n3 = fig.data3.normal();
+    Vec3 shadingNorma = (n3 + u * (n1 - n3) + v * (n2 - n3)).normalize();
+    Vec2 texcoords = Vec2(
+        fig.data3.texcoords.x + u * (fig.data.texcoords.x - fig.data3.texcoords.x) + v * (fig.data2.texcoords.x - fig.data3.texcoords.x),
+        fig.data3.texcoords.y + u * (fig.data.texcoords.y - fig.data3.texcoords.y) + v * (fig.data2.texcoords.y - fig.data3.texcoords.y)
+    );
+    Vec3 t1 = fig.data.tangent().v, t2 = fig.data2.tangent().v, t3 = fig.data3.tangent().v;
+    Vec4 tangent = Vec4((t3 + u * (t1 - t3) + v * (t2 - t3)).normalize(), fig.data.tangentSign);
+    if (isInside) {
+        shadingNorma = -1. * shadingNorma;
+    }
+    return {{t, geomNorma.normalize(), texcoords, shadingNorma, tangent, isInside}};
+}
+
+Vec3 normalize(const Vec3 &p) {
+    return 1. / sqrt(p.len2()) * p;
+}
+
+Vec3 fresnelTerm(const Vec3 &f0, const Vec3 &f90, const Vec3 &v, const Vec3 &h) {
+    return f0 + pow(std::max<float>(0.f, 1.f - fabs(v.dot(h))), 5.0) * (f90 - f0);
+}
+
+float specularBrdf(const Vec3 &l, const Vec3 &v, const Vec3 &n, float alpha2) {
+    Vec3 h = normalize(l + v);
+    if (h.dot(l) < 1e-4 || h.dot(v) < 1e-4) {
+        return 0;
+    }
+    float dotHN = h.dot(n);
+    float d = dotHN <= 0 ? 0 : alpha2 / (M_PI * pow(std::max(0.f, (alpha2 - 1) * dotHN * dotHN + 1), 2.0));
+    float vl = 1. / (fabs(n.dot(l)) + sqrt(std::max(0.f, alpha2 + (1 - alpha2) * n.dot(l) * n.dot(l))));
+    float vv = 1. / (fabs(n.dot(v)) + sqrt(std::max(0.f, alpha2 + (1 - alpha2) * n.dot(v) * n.dot(v))));
+    return d * vl * vv;
+}
+
+Vec3 brdf(const Vec3 &l, const Vec3 &v, const Vec3 &n, const Color &color, float metallic, float alpha) {
+    Vec3 h = normalize(l + v);
+    float specular = specularBrdf(l, v, n, alpha * alpha);
+    Vec3 metalBrdf, dieletricBrdf;
+    if (metallic > 0 && v.dot(n) >= 0 && l.dot(n) >= 0) {
+        metalBrdf = specular * fresnelTerm(color, {1, 1, 1}, v, h);
+    }
+    if (metallic < 1) {
+        Vec3 diffuse;
+        if (l.dot(n) >= 0) {
+            diffuse = (1. / M_PI) * color;
+        }
+        Vec3 ft = fresnelTerm({0.04, 0.04, 0.04}, {1, 1, 1}, v, h);
+        dieletricBrdf = diffuse * (Vec3{1, 1, 1} - ft) + specular * ft;
+    }
+    return (1.0 - metallic) * dieletricBrdf + metallic * metalBrdf;
+}
+
+}
+
+static std::mt19937 rng(1);
+
+static float uniform(float a, float b) {
+    return std::uniform_real_distribution<float>(a, b)(rng);
+}
+
+static Vec3 randomPoint(float r) {
+    return Vec3(uniform(-r, r), uniform(-r, r), uniform(-r, r));
+}
+
+static Vec3 randomDirection() {
+    while (true) {
+        Vec3 p = randomPoint(1);
+        if (p.len2() > 1e-2f && p.len2() <= 1) {
+            return p.normalize();
+        }
+    }
+}
+
+// Keeps results alive without the cost of printing them
+static volatile float sink;
+
+template <typename F>
+static double nsPerCall(size_t iterations, size_t inputs, F f) {
+    float acc = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < iterations; i++) {
+        acc += f(i % inputs);
+    }
+    auto elapsed = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+    sink = acc;
+    return elapsed / iterations;
+}
+
+template <typename F, typename G>
+static void compare(const char *name, size_t iterations, size_t inputs, F old, G current) {
+    double oldNs = nsPerCall(iterations, inputs, old);
+    double newNs = nsPerCall(iterations, inputs, current);
+    std::cout << std::setw(12) << name << std::fixed << std::setprecision(2)
+              << std::setw(12) << oldNs << std::setw(12) << newNs
+              << std::setw(10) << oldNs / newNs << "x" << std::endl;
+}
+
+int main(int argc, const char *argv[]) {
+    size_t iterations = argc > 1 ? strtoull(argv[1], nullptr, 10) : 20000000;
+    const size_t inputs = 4096;
+
+    std::vector<Ray> rays(inputs);
+    std::vector<PreparedRay> preparedRays;
+    std::vector<AABB> boxes(inputs);
+    std::vector<Figure> figures(inputs);
+    std::vector<Vec3> ls(inputs), vs(inputs), ns(inputs), unnormalized(inputs);
+    std::vector<Color> colors(inputs);
+    std::vector<float> metallics(inputs), alphas(inputs);
+    for (size_t i = 0; i < inputs; i++) {
+        rays[i] = Ray(randomPoint(4), randomDirection());
+        preparedRays.push_back(PreparedRay(rays[i]));
+        Vec3 corner = randomPoint(2);
+        boxes[i] = AABB(corner, corner + Vec3(uniform(0.1f, 2), uniform(0.1f, 2), uniform(0.1f, 2)));
+        // Triangles around the ray so that about half of the tests hit
+        Vec3 center = rays[i].o + uniform(0.5f, 3) * rays[i].d;
+        auto vertex = [&center]() {
+            return Vertex(center + randomPoint(1), Vec2(uniform(0, 1), uniform(0, 1)), randomDirection(), Vec4(randomDirection(), 1));
+        };
+        figures[i] = Figure(vertex(), vertex(), vertex());
+        ns[i] = randomDirection();
+        ls[i] = randomDirection();
+        vs[i] = randomDirection();
+        unnormalized[i] = randomPoint(10);
+        colors[i] = Color(uniform(0, 1), uniform(0, 1), uniform(0, 1));
+        metallics[i] = uniform(0, 1) < 0.5f ? 0 : uniform(0, 1);
+        alphas[i] = uniform(0.05f, 1);
+    }
+    MaterialModel material(1, Color(1, 1, 1));
+
+    std::cout << std::setw(12) << "kernel" << std::setw(12) << "old ns" << std::setw(12) << "new ns" << std::setw(11) << "speedup" << std::endl;
+    compare("box", iterations, inputs,
+        [&](size_t i) {
+            auto hit = reference::intersectBox(boxes[i], rays[i]);
+            return hit.has_value() ? hit.value().first : 0.f;
+        },
+        [&](size_t i) {
+            auto hit = boxes[i].intersect(preparedRays[i]);
+            return hit.has_value() ? hit.value().t : 0.f;
+        });
+    compare("triangle", iterations, inputs,
+        [&](size_t i) {
+            auto hit = reference::intersectTriangle(figures[i], rays[i]);
+            return hit.has_value() ? hit.value().t : 0.f;
+        },
+        [&](size_t i) {
+            auto hit = figures[i].hit(preparedRays[i]);
+            return hit.has_value() ? hit.value().t : 0.f;
+        });
+    compare("normalize", iterations, inputs,
+        [&](size_t i) { return reference::normalize(unnormalized[i]).x; },
+        [&](size_t i) { return fastNormalize(unnormalized[i]).x; });
+    // A shading point is built once per hit and serves both BRDF evaluations of the vertex
+    std::vector<ShadingPoint> points;
+    for (size_t i = 0; i < inputs; i++) {
+        points.push_back(ShadingPoint(Vec3(0, 0, 0), ns[i], vs[i], material.albedo(colors[i]), material.metallic(metallics[i]), alphas[i]));
+    }
+    compare("brdf", iterations, inputs,
+        [&](size_t i) { return reference::brdf(ls[i], vs[i], ns[i], colors[i], metallics[i], alphas[i]).x; },
+        [&](size_t i) { return material.brdf(points[i], ls[i]).x; });
+    return 0;
+}